@@ -35,13 +35,15 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <time.h>
 #if defined(__unix__) || defined(__APPLE__) || defined(__MACH__)
 #include <unistd.h>
 #endif
-#ifndef HAVE_USLEEP
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/times.h>
 #include <sys/param.h>
+#ifndef HAVE_USLEEP
 #include <sys/time.h>
 #endif
 #ifndef HAVE_USLEEP
@@ -49,6 +51,38 @@
 #define HAVE_USLEEP 1
 #endif
 #endif
+#ifndef HAVE_MMAP
+#if defined(__APPLE__) || defined(__MACH__) || defined(__linux__)
+#define HAVE_MMAP 1
+#endif
+#endif
+#ifdef HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#ifndef HAVE_SOCKETS
+#if defined(__APPLE__) || defined(__MACH__) || defined(__linux__)
+#define HAVE_SOCKETS 1
+#endif
+#endif
+#ifdef HAVE_SOCKETS
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+/* -j also needs open_memstream(), which strict ANSI builds hide */
+#ifndef HAVE_PTHREADS
+#if (defined(__APPLE__) || defined(__MACH__) || defined(__linux__)) && !defined(__STRICT_ANSI__)
+#define HAVE_PTHREADS 1
+#endif
+#endif
+#ifdef HAVE_PTHREADS
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#endif
+#include "basic.h"
 
 /* 211BSD-friendly BASIC interpreter targeting CBM BASIC v2 style programs.
  * Implements a minimal but compatible feature set: line-numbered programs,
@@ -56,13 +90,36 @@
  * REM, END/STOP and statement separators (:). */
 
 #define MAX_LINES 1024
-#define MAX_LINE_LEN 256
-#define MAX_VARS 128
-#define MAX_GOSUB 64
+#define MAX_LINE_NUMBER 65535L  /* line numbers are 16 bits in TOK_LINE */
+#define MAX_LINE_LEN 256    /* INPUT line length */
+#define MAX_LINE_CODE 0xffffL   /* crunched line; lengths in it are 16 bits */
+#ifndef ARENA_BLOCK
+#define ARENA_BLOCK 4096
+#endif
+#define MAX_VARS 128    /* must stay below 256, see var_slot_table */
+#ifndef MAX_GOSUB
+#define MAX_GOSUB 8192  /* GOSUB frames; the stack grows to this as needed */
+#endif
+#define GOSUB_CHUNK 64
+#define ON_ENTRY 6      /* bytes per ON table entry: TOK_LINE and a comma */
 #define MAX_FOR 32
 #define MAX_STR_LEN 256
+#ifndef STRING_SPACE
+#define STRING_SPACE 16384
+#endif
+#define MAX_STR_ROOTS 64
 #define DEFAULT_ARRAY_SIZE 11
+#define MAX_DIMS 4
+#define MAX_LINE_IFS 8  /* IFs open at once on one line */
+#define EVAL_STACK 64   /* values pending while evaluating an expression */
 #define PRINT_WIDTH 80
+#ifndef OUTPUT_BUFFER
+#define OUTPUT_BUFFER 4096
+#endif
+#define PROFILE_LINES 20   /* lines listed in the -p report */
+#ifndef INPUT_BUFFER
+#define INPUT_BUFFER 4096
+#endif
 #ifndef TICKS_PER_SEC_FALLBACK
 #ifdef HZ
 #define TICKS_PER_SEC_FALLBACK HZ
@@ -71,101 +128,566 @@
 #endif
 #endif
 
-enum value_type { VAL_NUM = 0, VAL_STR = 1 };
+enum value_type { VAL_NUM = 0, VAL_STR = 1, VAL_INT = 2 };
+
+/* Range of integer (%) variables and of VAL_INT values, as in CBM BASIC */
+#define MIN_INTVAR (-32767 - 1)
+#define MAX_INTVAR 32767
+
+/* Token codes produced by crunch_line().  Like CBM BASIC, keywords are
+ * stored as single bytes >= 0x80 while operators and punctuation stay as
+ * plain ASCII.  Numeric literals, string literals and variable names are
+ * decoded once at load and carry their operands inline:
+ *
+ *   TOK_NUM  <double, native byte order>
+ *   TOK_INUM <value s16>   (integral literals that fit an integer variable)
+ *   TOK_STR  <length lo> <length hi> <bytes>
+ *   TOK_VAR  <slot u16>
+ *   TOK_LINE <line number u16> <line index u16>
+ *   TOK_IF   <skip u16>
+ *   TOK_ON   <table entries u16>
+ *   TOK_DATA <length u16> <raw item text>
+ *   TOK_EXPR <length u16> <compiled expression, see enum opcode>
+ *
+ * Variables are bound to their vars[] slot while crunching, so a reference
+ * at run time is a single index.  TOK_LINE replaces the literal line
+ * number after GOTO, GOSUB and THEN; its index is filled in by
+ * resolve_line_refs() once the whole program is loaded, so jumps never
+ * search the line table at run time.  TOK_LINE also follows ELSE.  An IF's
+ * skip is the distance from the end of its operand to just past its ELSE,
+ * or to the end of the line when it has none, so a false condition jumps
+ * there directly.  An ON statement's GOTO or GOSUB is followed by a table
+ * of TOK_LINEs, ON_ENTRY bytes apart, so the selected target is found by
+ * indexing.  Multi-byte integers are little-endian.
+ *
+ * TI and TI$ are the clock rather than variables, as in CBM BASIC, and
+ * crunch to TOK_TI and TOK_TI_S.  Longer names such as TIME are ordinary
+ * variables.
+ *
+ * Spaces outside string literals are dropped and a line ends at a 0 byte.
+ * Operands may themselves contain 0 bytes, so crunched code must always be
+ * walked token by token (see skip_token()). */
+enum token {
+    TOK_NUM = 0x80,
+    TOK_STR,
+    TOK_VAR,
+    TOK_LINE,
+    TOK_BAD,
+    TOK_INUM,
+    TOK_EXPR,
+    TOK_TI,
+    TOK_TI_S,
+    /* Statements */
+    TOK_PRINT = 0x90,
+    TOK_INPUT,
+    TOK_LET,
+    TOK_GOTO,
+    TOK_GOSUB,
+    TOK_RETURN,
+    TOK_IF,
+    TOK_FOR,
+    TOK_NEXT,
+    TOK_DIM,
+    TOK_REM,
+    TOK_END,
+    TOK_STOP,
+    TOK_SLEEP,
+    TOK_DATA,
+    TOK_READ,
+    TOK_RESTORE,
+    TOK_ON,
+    TOK_MAT,
+    /* Secondary keywords and operators */
+    TOK_THEN = 0xb0,
+    TOK_TO,
+    TOK_STEP,
+    TOK_AND,
+    TOK_OR,
+    TOK_ELSE,
+    /* Intrinsic functions */
+    TOK_SIN = 0xc0,
+    TOK_COS,
+    TOK_TAN,
+    TOK_ATN,
+    TOK_ABS,
+    TOK_INT,
+    TOK_SQR,
+    TOK_SGN,
+    TOK_EXP,
+    TOK_LOG,
+    TOK_RND,
+    TOK_LEN,
+    TOK_VAL,
+    TOK_STR_S,
+    TOK_CHR_S,
+    TOK_ASC,
+    TOK_NOT,
+    TOK_FRE,
+    TOK_POS,
+    TOK_TAB,
+    TOK_STAT,
+    TOK_LEFT_S,
+    TOK_RIGHT_S,
+    TOK_MID_S,
+    TOK_INSTR,
+    /* Functions of whole arrays */
+    TOK_SUM,
+    TOK_DOT,
+    TOK_FIND
+};
+
+#define TOK_FIRST_FUNC TOK_SIN
+#define TOK_LAST_FUNC TOK_FIND
+#define TOK_FIRST_ARRAY_FUNC TOK_SUM
+
+/* Index stored in a TOK_LINE whose target does not exist */
+#define NO_LINE 0xffff
+
+/* Operations inside a TOK_EXPR block.  compile_line() turns each
+ * expression into postfix form once at load, so run_expr() only pushes
+ * already-decoded operands and applies operators; constant
+ * subexpressions are folded to a single OP_INUM or OP_NUM.
+ *
+ *   OP_INUM <value s16>        OP_VAR  <slot u16>
+ *   OP_NUM  <double>           OP_ELEM <slot u16> <subscripts>
+ *   OP_STR  <length u16> <bytes>
+ *   OP_FUNC <function token> <arguments>
+ *   OP_AFUNC <array function token> <slot u16> <slot u16>
+ *   OP_ERROR <index into compile_errors[]>
+ *
+ * The rest take their operands from the evaluation stack. */
+enum opcode {
+    OP_INUM = 1,
+    OP_NUM,
+    OP_STR,
+    OP_VAR,
+    OP_ELEM,
+    OP_FUNC,
+    OP_NEG,
+    OP_POS,
+    OP_POW,
+    OP_MUL,
+    OP_DIV,
+    OP_ADD,
+    OP_SUB,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_GT,
+    OP_LE,
+    OP_GE,
+    OP_AND,
+    OP_OR,
+    OP_AFUNC,
+    OP_ERROR
+};
+
+struct keyword {
+    const char *name;
+    int token;
+};
+
+/* Keyword spellings recognised by the cruncher.  A keyword only matches a
+ * whole identifier, so TOTAL stays a variable rather than TO + TAL. */
+static const struct keyword keywords[] = {
+    { "PRINT", TOK_PRINT },
+    { "INPUT", TOK_INPUT },
+    { "LET", TOK_LET },
+    { "GOTO", TOK_GOTO },
+    { "GOSUB", TOK_GOSUB },
+    { "RETURN", TOK_RETURN },
+    { "IF", TOK_IF },
+    { "FOR", TOK_FOR },
+    { "NEXT", TOK_NEXT },
+    { "DIM", TOK_DIM },
+    { "REM", TOK_REM },
+    { "END", TOK_END },
+    { "STOP", TOK_STOP },
+    { "SLEEP", TOK_SLEEP },
+    { "DATA", TOK_DATA },
+    { "READ", TOK_READ },
+    { "RESTORE", TOK_RESTORE },
+    { "ON", TOK_ON },
+    { "MAT", TOK_MAT },
+    { "THEN", TOK_THEN },
+    { "TO", TOK_TO },
+    { "STEP", TOK_STEP },
+    { "AND", TOK_AND },
+    { "OR", TOK_OR },
+    { "ELSE", TOK_ELSE },
+    { "SIN", TOK_SIN },
+    { "COS", TOK_COS },
+    { "TAN", TOK_TAN },
+    { "ATN", TOK_ATN },
+    { "ABS", TOK_ABS },
+    { "INT", TOK_INT },
+    { "SQR", TOK_SQR },
+    { "SGN", TOK_SGN },
+    { "EXP", TOK_EXP },
+    { "LOG", TOK_LOG },
+    { "RND", TOK_RND },
+    { "LEN", TOK_LEN },
+    { "VAL", TOK_VAL },
+    { "STR$", TOK_STR_S },
+    { "CHR$", TOK_CHR_S },
+    { "ASC", TOK_ASC },
+    { "NOT", TOK_NOT },
+    { "FRE", TOK_FRE },
+    { "POS", TOK_POS },
+    { "TAB", TOK_TAB },
+    { "STAT", TOK_STAT },
+    { "LEFT$", TOK_LEFT_S },
+    { "RIGHT$", TOK_RIGHT_S },
+    { "MID$", TOK_MID_S },
+    { "INSTR", TOK_INSTR },
+    { "SUM", TOK_SUM },
+    { "DOT", TOK_DOT },
+    { "FIND", TOK_FIND },
+    { "TI", TOK_TI },
+    { "TI$", TOK_TI_S },
+    { NULL, 0 }
+};
+
+#define KEYWORD_COUNT (sizeof(keywords) / sizeof(keywords[0]) - 1)
 
+/* First-letter index into keywords[], see build_keyword_index() */
+static unsigned char keyword_head[26];
+static unsigned char keyword_next[KEYWORD_COUNT];
+static int keyword_index_built = 0;
+
+/* A value is a type tag plus either a number or a string descriptor, as
+ * in CBM BASIC.  Numbers are VAL_INT while they are integral and within
+ * the integer variable range, so counter and index arithmetic needs no
+ * floating point; anything else is promoted to VAL_NUM.  String bytes are
+ * immutable and not NUL-terminated; they live either in the crunched
+ * program (literals) or in the string space, and any number of descriptors
+ * may share or overlap them. */
 struct value {
     int type;
-    double num;
-    char str[MAX_STR_LEN];
+    int len;            /* string length, VAL_STR only */
+    union {
+        double num;
+        int ival;       /* VAL_INT, always MIN_INTVAR..MAX_INTVAR */
+        char *str;
+    } u;
 };
 
+
 struct line {
     int number;
-    char *text;
+    unsigned char *code;
+    int data_index;     /* first DATA item at or after this line */
+};
+
+/* One DATA item: its text, for READ into a string, and its value when it
+ * reads as a number. */
+struct data_item {
+    struct value text;
+    struct value num;
+    int is_num;
 };
 
+/* A variable has a scalar value and, once dimensioned, an array of the
+ * same type: numeric elements are stored as a plain double block and
+ * string elements as descriptors.  Multi-dimensional arrays share the
+ * one block in row-major order, with a stride per subscript. */
 struct var {
     char name1;
     char name2;
     int is_string;
+    int is_int;
     int is_array;
     int size;
+    int ndims;
+    int extent[MAX_DIMS];
+    int stride[MAX_DIMS];
     struct value scalar;
-    struct value *array;
+    double *num_array;
+    int *int_array;
+    struct value *str_array;
 };
 
+/* Storage location resolved by get_var_reference(). */
+struct lvalue {
+    int is_string;
+    int is_int;
+    int is_array;
+    double *num;        /* numeric scalar or element */
+    int *ival;          /* integer scalar or element */
+    struct value *str;  /* string scalar or element */
+};
+
+/* A GOSUB return address: the calling line and the offset in its code
+ * of the statement end after the GOSUB. */
 struct gosub_frame {
     int line_index;
-    char *position;
+    int offset;
 };
 
+/* An active FOR loop.  Real counters use var/end_value/step and integer
+ * (%) counters ivar/iend/istep; the limit is always compared after the
+ * step is added, in the direction given by `descending'. */
 struct for_frame {
-    char name1;
-    char name2;
-    int is_string;
+    int slot;
+    int is_int;
+    int descending;
+    double *var;
     double end_value;
     double step;
+    int *ivar;
+    int iend;
+    int istep;
     int line_index;
-    char *resume_pos;
-    struct value *var;
+    unsigned char *resume_pos;
+};
+
+/* Growable output buffer used while crunching a line. */
+struct codebuf {
+    unsigned char *data;
+    int len;
+    int cap;
+};
+
+/* Letters and digits that can follow the first letter of a variable
+ * name, plus none; see var_slot_table */
+#define VAR_NAME2_CODES 37
+
+/* Header of each block of the code arena */
+struct arena_block {
+    struct arena_block *next;
 };
 
-static struct line *program_lines[MAX_LINES];
-static int line_count = 0;
+/* Initial RND state, also restored by each reset */
+#define RND_SEED 2463534242UL
+
+/* Every one-character string, so CHR$ needs no string space.  Built by
+ * init_tables() before the first interpreter is created. */
+static char chr_table[256];
+static int chr_table_ready = 0;
+
+/* The jiffy clock counts 60Hz ticks from the creation of the first
+ * interpreter, reading times() at the system clock rate. */
+#define JIFFIES_PER_SEC 60
+#define JIFFIES_PER_DAY 5184000L    /* TI and TI$ wrap at midnight */
+static clock_t clock_origin;
+static long clock_rate = 0;
+
+/* Every piece of state one program run needs lives in an interpreter
+ * context, passed to each function that touches it, so a process can hold
+ * any number of independent interpreters (see basic.h). */
+struct interp {
+    /* The program: one array of line records, sized from the source
+     * file, kept sorted by line number.  Crunched code for every line is
+     * carved out of arena blocks of arena_block bytes that are never
+     * moved; arena_blocks chains them for basic_free(). */
+    struct line *program_lines;
+    int line_count;
+    int line_capacity;
+    int arena_block;
+    unsigned char *arena_next;
+    int arena_left;
+    struct arena_block *arena_blocks;
+    char *image_buf;        /* code loaded by load_image() */
+    int source_mapped;
+    int shared;             /* program_lines and data_pool belong to the
+                             * context this was cloned from */
+
+    /* Scratch buffers reused for crunching and compiling each line */
+    struct codebuf crunch_buf;
+    struct codebuf compile_buf;
+
+    struct var vars[MAX_VARS];
+    int var_count;
+
+    /* Direct-mapped name -> slot table.  A name is one letter, an
+     * optional letter or digit and a type (real, integer or string),
+     * which gives 26 * 37 * 3 keys; each entry holds slot + 1 so that
+     * zero means "not yet created". */
+    unsigned char var_slot_table[26 * VAR_NAME2_CODES * 3];
+
+    struct gosub_frame *gosub_stack;
+    int gosub_top;
+    int gosub_cap;
+
+    struct for_frame for_stack[MAX_FOR];
+    int for_top;
+
+    /* String space: bump allocated from the bottom and compacted by
+     * collect_garbage() when full.  str_roots[] registers values held in
+     * C locals across a call that may allocate, so the collector can see
+     * them. */
+    char str_space[STRING_SPACE];
+    char *str_top;
+    struct value *str_roots[MAX_STR_ROOTS];
+    int str_root_top;
+
+    /* Operands of the expression being evaluated; entries below eval_top
+     * are GC roots.  `folding' is set while the compiler evaluates
+     * constant subexpressions, whose errors are not reported. */
+    struct value eval_stack[EVAL_STACK];
+    int eval_top;
+    int folding;
+
+    unsigned long rnd_state;    /* RND: 32-bit xorshift, never zero */
 
-static struct var vars[MAX_VARS];
-static int var_count = 0;
+    int current_line;
+    unsigned char *statement_pos;
+    int halted;
+    const char *error;      /* message of the error that halted the run */
+    int print_col;
 
-static struct gosub_frame gosub_stack[MAX_GOSUB];
-static int gosub_top = 0;
+    /* -g: grow arrays on out-of-range subscripts instead of failing, as
+     * earlier versions of this interpreter did. */
+    int array_autogrow;
 
-static struct for_frame for_stack[MAX_FOR];
-static int for_top = 0;
+    /* Program output is collected in out_buf and written to `out' in
+     * large blocks.  When out_interactive is set (stdout is a terminal,
+     * or -u) it is also flushed after every PRINT; otherwise only before
+     * INPUT and SLEEP, when the buffer fills and at exit.  -1 until
+     * run_start() decides.  Error messages and the profile go to `err'. */
+    FILE *out;
+    FILE *err;
+    char out_buf[OUTPUT_BUFFER];
+    int out_len;
+    int out_interactive;
 
-static int current_line = 0;
-static char *statement_pos = NULL;
-static int halted = 0;
-static int print_col = 0;
+    /* INPUT reads descriptor in_fd through in_buf a block at a time.  In
+     * batch mode (stdin is not a terminal, or -n) no prompts are printed.
+     * -1 until run_start() decides. */
+    int in_fd;
+    char in_buf[INPUT_BUFFER];
+    int in_pos;
+    int in_len;
+    int input_batch;
+
+    /* DATA items of the whole program, built once at load */
+    struct data_item *data_pool;
+    int data_count;
+    int data_cap;
+    int data_next;
+
+    /* Profiler (-p, -pt): per program line the times execution entered
+     * it and the statements run in it, per keyword the statements run,
+     * and with -pt the CPU time spent in each line, attributed between
+     * consecutive statements.  A line is entered when the statement
+     * before was on another line or at or after this one, as when NEXT
+     * loops back.  The only cost when it is off is the test of
+     * `profiling' in run_statements(). */
+    int profiling;
+    int profile_time;
+    long *prof_hits;
+    long *prof_line_stmts;
+    double *prof_time;
+    long prof_stmt[256];
+    long prof_total;
+    int prof_last_line;
+    clock_t prof_last_clock;
+    int prof_prev_line;
+    unsigned char *prof_prev_pos;
+
+    int running;            /* a run is under way, see basic_step() */
+
+    /* With sleep_yield set, SLEEP does not wait: it sets `sleeping' and
+     * the jiffy clock time to resume at, and the run stops there until
+     * basic_step() is called after that time. */
+    int sleep_yield;
+    int sleeping;
+    unsigned long wake_time;
+
+    /* TI is the jiffy clock plus clock_offset, modulo a day; setting TI$
+     * changes the offset. */
+    unsigned long clock_offset;
+
+    /* Run statistics (-t, STAT()), kept always since each is a single
+     * add or compare where it happens.  All but stat_vars, which counts
+     * variables created while loading, restart with every run. */
+    long stat_statements;
+    long stat_gotos;
+    long stat_gosubs;
+    long stat_vars;
+    long stat_resizes;
+    long stat_str_bytes;
+    long stat_str_peak;
+    int stat_for_peak;
+    int stat_gosub_peak;
+    unsigned long stat_start;
+    unsigned long stat_end;
+    int stats;              /* -t: report them at the end of the run */
+};
 
 /* Forward declarations */
-static void runtime_error(const char *msg);
-static void load_program(const char *path);
-static int find_line_index(int number);
-static int starts_with_kw(char *p, const char *kw);
+static void runtime_error(struct interp *ctx, const char *msg);
+static int load_program(struct interp *ctx, const char *path);
+static int find_line_index(struct interp *ctx, int number);
 static void skip_spaces(char **p);
 static int parse_number_literal(char **p, double *out);
-static int read_identifier(char **p, char *buf, int buf_size);
-static char *dupstr_local(const char *s);
-static struct value eval_expr(char **p);
-static struct value eval_comparison(char **p);
-static struct value eval_or_expr(char **p);
-static int eval_condition(char **p);
-static void execute_statement(char **p);
-static struct value *get_var_reference(char **p, int *is_array_out, int *is_string_out);
+static unsigned char *crunch_line(struct interp *ctx, const char *text);
+static unsigned char *skip_token(unsigned char *p);
+static struct codebuf *compile_line(struct interp *ctx, struct codebuf *src);
+static struct value eval_expression(struct interp *ctx, unsigned char **p);
+static int eval_condition(struct interp *ctx, unsigned char **p);
+static void execute_statement(struct interp *ctx, unsigned char **p);
+static int get_var_reference(struct interp *ctx, unsigned char **p, struct lvalue *lv);
 static struct value make_num(double v);
-static struct value make_str(const char *s);
-static struct var *find_or_create_var(char name1, char name2, int is_string, int want_array, int array_size);
-static struct value eval_function(const char *name, char **p);
-static void print_value(struct value *v);
-static void print_spaces(int count);
-static void statement_sleep(char **p);
+static struct value make_str(struct interp *ctx, const char *s);
+static struct value make_str_len(struct interp *ctx, const char *s, int len);
+static struct value make_str_ref(char *s, int len);
+static char *str_alloc(struct interp *ctx, int len);
+static struct var *find_or_create_var(struct interp *ctx, char name1, char name2, int type);
+static int dim_array(struct interp *ctx, struct var *v, int size);
+static struct value call_function(struct interp *ctx, int func, struct value *args, int nargs);
+static void print_value(struct interp *ctx, struct value *v);
+static void print_spaces(struct interp *ctx, int count);
+static void statement_sleep(struct interp *ctx, unsigned char **p);
 static void do_sleep_ticks(double ticks);
 
-/* Report an error and halt further execution. */
-static void runtime_error(const char *msg)
+/* Write out any buffered program output. */
+static void out_flush(struct interp *ctx)
+{
+    if (ctx->out_len > 0) {
+        fwrite(ctx->out_buf, 1, ctx->out_len, ctx->out);
+        ctx->out_len = 0;
+    }
+    fflush(ctx->out);
+}
+
+/* Append one character of program output. */
+static void out_char(struct interp *ctx, int c)
+{
+    if (ctx->out_len >= OUTPUT_BUFFER) {
+        out_flush(ctx);
+    }
+    ctx->out_buf[ctx->out_len++] = (char)c;
+}
+
+/* Append a run of program output. */
+static void out_bytes(struct interp *ctx, const char *s, int n)
 {
-    fprintf(stderr, "Error: %s\n", msg);
-    halted = 1;
+    int room;
+    while (n > 0) {
+        if (ctx->out_len >= OUTPUT_BUFFER) {
+            out_flush(ctx);
+        }
+        room = OUTPUT_BUFFER - ctx->out_len;
+        if (room > n) {
+            room = n;
+        }
+        memcpy(ctx->out_buf + ctx->out_len, s, room);
+        ctx->out_len += room;
+        s += room;
+        n -= room;
+    }
 }
 
-/* Strip trailing newline from a buffer if present. */
-static void trim_newline(char *s)
+/* Report an error and halt further execution. */
+static void runtime_error(struct interp *ctx, const char *msg)
 {
-    char *p;
-    p = strchr(s, '\n');
-    if (p) {
-        *p = '\0';
+    if (!ctx->folding) {
+        out_flush(ctx);
+        fprintf(ctx->err, "Error: %s\n", msg);
+        ctx->error = msg;
     }
+    ctx->halted = 1;
 }
 
 /* Advance pointer past spaces/tabs. */
@@ -176,43 +698,93 @@ static void skip_spaces(char **p)
     }
 }
 
-/* Parse a numeric literal from the character stream. */
+/* Powers of ten that a double holds exactly */
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define MAX_EXACT_POW10 22
+#define MAX_EXACT_DIGITS 15     /* decimal digits a double always holds */
+
+/* Parse a numeric literal from the character stream.  Digits are
+ * accumulated as they are scanned; when the mantissa has at most
+ * MAX_EXACT_DIGITS digits and the scale is an exact power of ten, one
+ * multiply or divide gives the correctly rounded value, as atof() would.
+ * Longer numbers still go through atof(). */
 static int parse_number_literal(char **p, double *out)
 {
     char buf[64];
     char *s;
     char *q;
     int len;
+    double mant;
+    int digits;
+    int scale;
+    int exp10;
+    int neg;
     s = *p;
     q = s;
+    neg = *q == '-';
     if (*q == '+' || *q == '-') {
         q++;
     }
+    mant = 0.0;
+    digits = 0;
+    scale = 0;
     while (isdigit((unsigned char)*q)) {
+        if (digits > 0 || *q != '0') {
+            digits++;
+        }
+        mant = mant * 10.0 + (*q - '0');
         q++;
     }
     if (*q == '.') {
         q++;
         while (isdigit((unsigned char)*q)) {
+            if (digits > 0 || *q != '0') {
+                digits++;
+            }
+            mant = mant * 10.0 + (*q - '0');
+            scale--;
             q++;
         }
     }
+    exp10 = 0;
     if (*q == 'e' || *q == 'E') {
         char *e;
+        int eneg;
         e = q + 1;
+        eneg = *e == '-';
         if (*e == '+' || *e == '-') {
             e++;
         }
         if (isdigit((unsigned char)*e)) {
             q = e;
             while (isdigit((unsigned char)*q)) {
+                if (exp10 < 1000) {
+                    exp10 = exp10 * 10 + (*q - '0');
+                }
                 q++;
             }
+            if (eneg) {
+                exp10 = -exp10;
+            }
         }
     }
     if (q == s || (s + 1 == q && (s[0] == '+' || s[0] == '-'))) {
         return 0;
     }
+    *p = q;
+    exp10 += scale;
+    if (digits <= MAX_EXACT_DIGITS && exp10 >= -MAX_EXACT_POW10 && exp10 <= MAX_EXACT_POW10) {
+        if (exp10 >= 0) {
+            mant *= exact_pow10[exp10];
+        } else {
+            mant /= exact_pow10[-exp10];
+        }
+        *out = neg ? -mant : mant;
+        return 1;
+    }
     len = q - s;
     if (len >= (int)sizeof(buf)) {
         len = sizeof(buf) - 1;
@@ -220,338 +792,1120 @@ static int parse_number_literal(char **p, double *out)
     strncpy(buf, s, len);
     buf[len] = '\0';
     *out = atof(buf);
-    *p = q;
     return 1;
 }
 
-/* Duplicate a string into heap memory. */
-static char *dupstr_local(const char *s)
+/* Convert text to a number as VAL and INPUT do: leading blanks are
+ * skipped, and text that does not start with a number is 0. */
+static double text_to_num(const char *text)
 {
-    size_t len;
-    char *p;
-    len = strlen(s) + 1;
-    p = (char *)malloc(len);
-    if (!p) {
-        runtime_error("Out of memory");
-        return NULL;
+    char *s;
+    double d;
+    s = (char *)text;
+    while (isspace((unsigned char)*s)) {
+        s++;
     }
-    memcpy(p, s, len);
-    return p;
+    d = 0.0;
+    if (!parse_number_literal(&s, &d)) {
+        return 0.0;
+    }
+    return d;
 }
 
-/* Check if the input starts with the keyword (case-insensitive). */
-static int starts_with_kw(char *p, const char *kw)
+/* Write `n' in decimal to `buf'; returns the length. */
+static int format_int(long n, char *buf)
 {
+    char digits[24];
+    unsigned long u;
+    int len;
     int i;
-    for (i = 0; kw[i]; i++) {
-        if (toupper((unsigned char)p[i]) != kw[i]) {
+    len = 0;
+    if (n < 0) {
+        buf[len++] = '-';
+        u = (unsigned long)-(n + 1) + 1;
+    } else {
+        u = (unsigned long)n;
+    }
+    i = 0;
+    do {
+        digits[i++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u > 0);
+    while (i > 0) {
+        buf[len++] = digits[--i];
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/* Format a number as printf("%g") does; returns the length.  Whole
+ * numbers below 1e6, which %g prints as plain digits, skip stdio. */
+static int format_number(double d, char *buf)
+{
+    static const double zero = 0.0;
+    if (d == floor(d) && d > -1e6 && d < 1e6 &&
+        (d != 0.0 || memcmp(&d, &zero, sizeof(double)) == 0)) {
+        return format_int((long)d, buf);
+    }
+    sprintf(buf, "%g", d);
+    return (int)strlen(buf);
+}
+
+/* Append one byte to a crunch buffer, growing it as needed. */
+static int emit_byte(struct interp *ctx, struct codebuf *cb, int c)
+{
+    if (cb->len >= cb->cap) {
+        unsigned char *grown;
+        int cap;
+        cap = cb->cap ? cb->cap * 2 : 64;
+        grown = (unsigned char *)realloc(cb->data, cap);
+        if (!grown) {
+            runtime_error(ctx, "Out of memory");
             return 0;
         }
+        cb->data = grown;
+        cb->cap = cap;
     }
-    if (p[i] == '\0' || p[i] == ' ' || p[i] == '\t' || p[i] == ':' || p[i] == '(' || p[i] == '$') {
-        return 1;
-    }
-    return 0;
+    cb->data[cb->len++] = (unsigned char)c;
+    return 1;
 }
 
-/* Check if input starts with a keyword that ends with $ (string functions) */
-static int starts_with_kw_dollar(char *p, const char *kw)
+/* Append a run of bytes to a crunch buffer. */
+static int emit_bytes(struct interp *ctx, struct codebuf *cb, const void *src, int len)
 {
+    const unsigned char *s;
     int i;
-    for (i = 0; kw[i]; i++) {
-        if (toupper((unsigned char)p[i]) != kw[i]) {
+    s = (const unsigned char *)src;
+    for (i = 0; i < len; i++) {
+        if (!emit_byte(ctx, cb, s[i])) {
             return 0;
         }
     }
     return 1;
 }
 
-/* Construct a numeric value wrapper. */
-static struct value make_num(double v)
+/* Fetch the inline double that follows a TOK_NUM. */
+static double get_num_operand(unsigned char *p)
 {
-    struct value out;
-    out.type = VAL_NUM;
-    out.num = v;
-    out.str[0] = '\0';
-    return out;
+    double d;
+    memcpy(&d, p, sizeof(double));
+    return d;
 }
 
-/* Construct a string value wrapper. */
-static struct value make_str(const char *s)
+/* Fetch a 16-bit little-endian operand. */
+static unsigned get_u16(unsigned char *p)
 {
-    struct value out;
-    out.type = VAL_STR;
-    out.num = 0.0;
-    strncpy(out.str, s, MAX_STR_LEN - 1);
-    out.str[MAX_STR_LEN - 1] = '\0';
-    return out;
+    return (unsigned)p[0] | ((unsigned)p[1] << 8);
 }
 
-/* Ensure the value is numeric or raise a runtime error. */
-static void ensure_num(struct value *v)
+/* Store a 16-bit little-endian operand. */
+static void put_u16(unsigned char *p, unsigned v)
 {
-    if (v->type != VAL_NUM) {
-        runtime_error("Numeric value required");
-    }
+    p[0] = (unsigned char)(v & 0xff);
+    p[1] = (unsigned char)((v >> 8) & 0xff);
 }
 
-/* Ensure the value is string or raise a runtime error. */
-static void ensure_str(struct value *v)
+/* Fetch a little-endian signed 16-bit operand. */
+static int get_s16(unsigned char *p)
 {
-    if (v->type != VAL_STR) {
-        runtime_error("String value required");
+    unsigned u;
+    u = get_u16(p);
+    return (u & 0x8000) ? -(int)(~u & 0x7fff) - 1 : (int)u;
+}
+
+/* Chain the keyword table by first letter.  keyword_head[] holds the
+ * first entry + 1 for each letter and keyword_next[] the entry after it,
+ * so a lookup only compares the few keywords sharing the first letter. */
+static void build_keyword_index(void)
+{
+    int i;
+    int letter;
+    for (i = 0; keywords[i].name; i++) {
+        ;
+    }
+    while (--i >= 0) {
+        letter = keywords[i].name[0] - 'A';
+        keyword_next[i] = keyword_head[letter];
+        keyword_head[letter] = (unsigned char)(i + 1);
     }
+    keyword_index_built = 1;
 }
 
-/* Emit spaces and track current print column. */
-static void print_spaces(int count)
+/* Look up an uppercased identifier in the keyword table. */
+static int lookup_keyword(const char *word)
 {
     int i;
-    for (i = 0; i < count; i++) {
-        fputc(' ', stdout);
-        print_col++;
-        if (print_col >= PRINT_WIDTH) {
-            fputc('\n', stdout);
-            print_col = 0;
+    if (word[0] < 'A' || word[0] > 'Z') {
+        return 0;
+    }
+    if (!keyword_index_built) {
+        build_keyword_index();
+    }
+    for (i = keyword_head[word[0] - 'A']; i; i = keyword_next[i - 1]) {
+        if (strcmp(keywords[i - 1].name + 1, word + 1) == 0) {
+            return keywords[i - 1].token;
         }
     }
+    return 0;
 }
 
-/* Emit a value (number or string) updating column tracking. */
-static void print_value(struct value *v)
+/* Carve `len' bytes out of the code arena. */
+static unsigned char *arena_alloc(struct interp *ctx, int len)
 {
-    if (v->type == VAL_STR) {
-        char *s;
-        s = v->str;
-        while (*s) {
-            fputc(*s, stdout);
-            if (*s == '\n') {
-                print_col = 0;
-            } else {
-                print_col++;
-                if (print_col >= PRINT_WIDTH) {
-                    fputc('\n', stdout);
-                    print_col = 0;
-                }
-            }
-            s++;
+    int size;
+    struct arena_block *block;
+    if (len > ctx->arena_left) {
+        size = len > ctx->arena_block ? len : ctx->arena_block;
+        block = (struct arena_block *)malloc(sizeof(struct arena_block) + size);
+        if (!block) {
+            ctx->arena_left = 0;
+            runtime_error(ctx, "Out of memory");
+            return NULL;
         }
-    } else {
-        char buf[64];
-        sprintf(buf, "%g", v->num);
-        fputs(buf, stdout);
-        print_col += (int)strlen(buf);
-    }
+        block->next = ctx->arena_blocks;
+        ctx->arena_blocks = block;
+        ctx->arena_next = (unsigned char *)(block + 1);
+        ctx->arena_left = size;
+        ctx->arena_block = ARENA_BLOCK;
+    }
+    ctx->arena_next += len;
+    ctx->arena_left -= len;
+    return ctx->arena_next - len;
 }
 
-/* Sleep for a number of 60Hz ticks, using the best timer available. */
-static void do_sleep_ticks(double ticks)
+/* Translate one line of source text into crunched tokens.  Returns the
+ * code, terminated by a 0 byte, in the code arena, or NULL on error. */
+static unsigned char *crunch_line(struct interp *ctx, const char *text)
 {
-    long usec;
-    unsigned int sec;
-#ifndef HAVE_USLEEP
-    struct timeval tv;
-#endif
-    if (ticks <= 0.0) {
-        return;
+    struct codebuf *cb;
+    unsigned char *code;
+    char *s;
+    int last_tok;
+    int on_stmt;        /* in an ON statement */
+    int line_list;      /* numbers are ON targets */
+    cb = &ctx->crunch_buf;
+    cb->len = 0;
+    s = (char *)text;
+    last_tok = 0;
+    on_stmt = 0;
+    line_list = 0;
+    for (;;) {
+        skip_spaces(&s);
+        if (*s == '\0') {
+            break;
+        }
+        if (isdigit((unsigned char)*s) &&
+            (last_tok == TOK_GOTO || last_tok == TOK_GOSUB || last_tok == TOK_THEN ||
+             last_tok == TOK_ELSE || last_tok == TOK_RESTORE || line_list)) {
+            long number;
+            number = 0;
+            while (isdigit((unsigned char)*s)) {
+                if (number <= MAX_LINE_NUMBER) {
+                    number = number * 10 + (*s - '0');
+                }
+                s++;
+            }
+            if (number > MAX_LINE_NUMBER) {
+                runtime_error(ctx, "Line number out of range");
+                return NULL;
+            }
+            if (!emit_byte(ctx, cb, TOK_LINE) || !emit_byte(ctx, cb, (int)(number & 0xff)) ||
+                !emit_byte(ctx, cb, (int)((number >> 8) & 0xff)) ||
+                !emit_byte(ctx, cb, NO_LINE & 0xff) || !emit_byte(ctx, cb, (NO_LINE >> 8) & 0xff)) {
+                return NULL;
+            }
+            last_tok = TOK_LINE;
+            continue;
+        }
+        last_tok = (unsigned char)*s;
+        if (*s == ':') {
+            on_stmt = 0;
+            line_list = 0;
+        } else if (*s != ',') {
+            line_list = 0;
+        }
+        if (*s == '\"') {
+            char *start;
+            int len;
+            s++;
+            start = s;
+            while (*s && *s != '\"') {
+                s++;
+            }
+            len = s - start;
+            if (!emit_byte(ctx, cb, TOK_STR) || !emit_byte(ctx, cb, len & 0xff) ||
+                !emit_byte(ctx, cb, (len >> 8) & 0xff) || !emit_bytes(ctx, cb, start, len)) {
+                return NULL;
+            }
+            if (*s == '\"') {
+                s++;
+            }
+            continue;
+        }
+        if (isdigit((unsigned char)*s) || (*s == '.' && isdigit((unsigned char)s[1]))) {
+            double num;
+            num = 0.0;
+            parse_number_literal(&s, &num);
+            if (num == floor(num) && num >= MIN_INTVAR && num <= MAX_INTVAR) {
+                int n;
+                n = (int)num;
+                if (!emit_byte(ctx, cb, TOK_INUM) || !emit_byte(ctx, cb, n & 0xff) ||
+                    !emit_byte(ctx, cb, (n >> 8) & 0xff)) {
+                    return NULL;
+                }
+                continue;
+            }
+            if (!emit_byte(ctx, cb, TOK_NUM) || !emit_bytes(ctx, cb, &num, sizeof(double))) {
+                return NULL;
+            }
+            continue;
+        }
+        if (isalpha((unsigned char)*s)) {
+            char word[16];
+            int i;
+            int tok;
+            i = 0;
+            while (isalpha((unsigned char)*s) || isdigit((unsigned char)*s)) {
+                if (i < (int)sizeof(word) - 2) {
+                    word[i++] = toupper((unsigned char)*s);
+                }
+                s++;
+            }
+            if (*s == '$' || *s == '%') {
+                word[i++] = *s;
+                s++;
+            }
+            word[i] = '\0';
+            tok = lookup_keyword(word);
+            if ((tok >= TOK_FIRST_ARRAY_FUNC && tok <= TOK_LAST_FUNC) || tok == TOK_STAT) {
+                /* Only a call, so SUM and FIND stay usable as variables */
+                char *t;
+                t = s;
+                skip_spaces(&t);
+                if (*t != '(') {
+                    tok = 0;
+                }
+            }
+            if (tok == TOK_REM) {
+                /* Comment text is never needed at run time */
+                if (!emit_byte(ctx, cb, TOK_REM)) {
+                    return NULL;
+                }
+                break;
+            }
+            if (tok == TOK_IF || tok == TOK_ON) {
+                /* The operand is filled in by compile_line() */
+                if (!emit_byte(ctx, cb, tok) || !emit_byte(ctx, cb, 0) || !emit_byte(ctx, cb, 0)) {
+                    return NULL;
+                }
+                on_stmt = tok == TOK_ON;
+                line_list = 0;
+                last_tok = tok;
+                continue;
+            }
+            if (tok == TOK_DATA) {
+                /* Items are kept as raw text and pooled after load */
+                char *start;
+                int len;
+                int quoted;
+                skip_spaces(&s);
+                start = s;
+                quoted = 0;
+                while (*s && (quoted || *s != ':')) {
+                    if (*s == '\"') {
+                        quoted = !quoted;
+                    }
+                    s++;
+                }
+                len = s - start;
+                if (!emit_byte(ctx, cb, TOK_DATA) || !emit_byte(ctx, cb, len & 0xff) ||
+                    !emit_byte(ctx, cb, (len >> 8) & 0xff) || !emit_bytes(ctx, cb, start, len)) {
+                    return NULL;
+                }
+                last_tok = tok;
+                continue;
+            }
+            if (tok) {
+                if (!emit_byte(ctx, cb, tok)) {
+                    return NULL;
+                }
+                line_list = on_stmt && (tok == TOK_GOTO || tok == TOK_GOSUB);
+                if (tok == TOK_ELSE) {
+                    on_stmt = 0;
+                }
+                last_tok = tok;
+                continue;
+            }
+            if (strcmp(word, "TI") == 0 || strcmp(word, "TI$") == 0) {
+                if (!emit_byte(ctx, cb, word[i - 1] == '$' ? TOK_TI_S : TOK_TI)) {
+                    return NULL;
+                }
+                continue;
+            }
+            {
+                struct var *v;
+                int slot;
+                v = find_or_create_var(ctx, word[0],
+                                       (i > 1 && word[1] != '$' && word[1] != '%') ? word[1] : ' ',
+                                       word[i - 1] == '$' ? VAL_STR :
+                                       word[i - 1] == '%' ? VAL_INT : VAL_NUM);
+                if (!v) {
+                    return NULL;
+                }
+                slot = v - ctx->vars;
+                if (!emit_byte(ctx, cb, TOK_VAR) || !emit_byte(ctx, cb, slot & 0xff) ||
+                    !emit_byte(ctx, cb, (slot >> 8) & 0xff)) {
+                    return NULL;
+                }
+            }
+            continue;
+        }
+        if (*s == '\'') {
+            if (!emit_byte(ctx, cb, TOK_REM)) {
+                return NULL;
+            }
+            break;
+        }
+        if (*s == '?') {
+            if (!emit_byte(ctx, cb, TOK_PRINT)) {
+                return NULL;
+            }
+            s++;
+            continue;
+        }
+        /* Operators and punctuation pass through; stray high bytes would
+         * alias tokens so they become a syntax error instead. */
+        if (!emit_byte(ctx, cb, ((unsigned char)*s >= 0x80) ? TOK_BAD : *s)) {
+            return NULL;
+        }
+        s++;
     }
-    usec = (long)(ticks * (1000000.0 / 60.0) + 0.5);
-    if (usec <= 0) {
-        return;
+    if (!emit_byte(ctx, cb, 0)) {
+        return NULL;
     }
-    sec = (unsigned int)(usec / 1000000L);
-    usec = usec % 1000000L;
-#ifdef HAVE_USLEEP
-    if (sec > 0) {
-        sleep(sec);
+    if ((long)cb->len > MAX_LINE_CODE) {
+        runtime_error(ctx, "Line too long");
+        return NULL;
     }
-    if (usec > 0) {
-        usleep((unsigned int)usec);
+    cb = compile_line(ctx, cb);
+    if (!cb) {
+        return NULL;
     }
-#else
-    /* No usleep; use select() for sub-second delay if available */
-    if (sec > 0) {
-        sleep(sec);
+    if ((long)cb->len > MAX_LINE_CODE) {
+        runtime_error(ctx, "Line too long");
+        return NULL;
     }
-    if (usec > 0) {
-        tv.tv_sec = 0;
-        tv.tv_usec = usec;
-        select(0, (fd_set *)0, (fd_set *)0, (fd_set *)0, &tv);
+    code = arena_alloc(ctx, cb->len);
+    if (!code) {
+        return NULL;
     }
-#endif
+    memcpy(code, cb->data, cb->len);
+    return code;
 }
 
-/* Parse SLEEP statement and pause execution. */
-static void statement_sleep(char **p)
+/* Step over one token and its inline operands. */
+static unsigned char *skip_token(unsigned char *p)
 {
-    struct value v;
-    skip_spaces(p);
-    if (**p == '(') {
-        (*p)++;
-        v = eval_or_expr(p);
-        skip_spaces(p);
-        if (**p == ')') {
-            (*p)++;
-        } else {
-            runtime_error("Missing ')'");
-            return;
-        }
-    } else {
-        v = eval_or_expr(p);
+    switch (*p) {
+    case TOK_NUM:
+        return p + 1 + sizeof(double);
+    case TOK_STR:
+    case TOK_DATA:
+    case TOK_EXPR:
+        return p + 3 + get_u16(p + 1);
+    case TOK_VAR:
+    case TOK_INUM:
+    case TOK_IF:
+    case TOK_ON:
+        return p + 3;
+    case TOK_LINE:
+        return p + 5;
+    default:
+        return p + 1;
     }
-    ensure_num(&v);
-    do_sleep_ticks(v.num);
 }
 
-/* Case-insensitive string match helper for function names. */
-static int name_equals(const char *a, const char *b)
+/* Does a statement end here?  ELSE ends the statement before it. */
+static int at_statement_end(unsigned char *p)
 {
-    while (*a && *b) {
-        if (toupper((unsigned char)*a) != *b) {
-            return 0;
-        }
-        a++;
-        b++;
-    }
-    return *a == '\0' && *b == '\0';
+    return *p == '\0' || *p == ':' || *p == TOK_ELSE;
 }
 
-/* Evaluate BASIC intrinsic functions (math/string/tab). */
-static struct value eval_function(const char *name, char **p)
+/* Advance to the 0 byte that ends the current line. */
+static void skip_to_eol(unsigned char **p)
 {
-    char tmp[16];
-    struct value arg;
+    while (**p) {
+        *p = skip_token(*p);
+    }
+}
+
+/* Construct a numeric value wrapper. */
+static struct value make_num(double v)
+{
+    struct value out;
+    out.type = VAL_NUM;
+    out.len = 0;
+    out.u.num = v;
+    return out;
+}
+
+/* Construct an integer value; `v' must be within the integer range. */
+static struct value make_int(int v)
+{
+    struct value out;
+    out.type = VAL_INT;
+    out.len = 0;
+    out.u.ival = v;
+    return out;
+}
+
+/* Construct a numeric value from an integer result, staying VAL_INT when
+ * it is in range. */
+static struct value make_long(long v)
+{
+    if (v >= MIN_INTVAR && v <= MAX_INTVAR) {
+        return make_int((int)v);
+    }
+    return make_num((double)v);
+}
+
+/* Wrap existing string bytes without copying them. */
+static struct value make_str_ref(char *s, int len)
+{
+    struct value out;
+    out.type = VAL_STR;
+    out.len = len;
+    out.u.str = s;
+    return out;
+}
+
+/* Construct a string value from a counted run of bytes, copied into the
+ * string space.  `s' must not itself point into the string space. */
+static struct value make_str_len(struct interp *ctx, const char *s, int len)
+{
+    char *buf;
+    if (len <= 0) {
+        return make_str_ref((char *)"", 0);
+    }
+    buf = str_alloc(ctx, len);
+    if (!buf) {
+        return make_str_ref((char *)"", 0);
+    }
+    memcpy(buf, s, len);
+    return make_str_ref(buf, len);
+}
+
+/* Construct a string value from a C string. */
+static struct value make_str(struct interp *ctx, const char *s)
+{
+    return make_str_len(ctx, s, (int)strlen(s));
+}
+
+/* Register a value held in a C local as a garbage collection root. */
+static void str_protect(struct interp *ctx, struct value *v)
+{
+    if (ctx->str_root_top >= MAX_STR_ROOTS) {
+        runtime_error(ctx, "Expression too complex");
+        return;
+    }
+    ctx->str_roots[ctx->str_root_top++] = v;
+}
+
+/* Drop the most recent `count' roots registered with str_protect(). */
+static void str_unprotect(struct interp *ctx, int count)
+{
+    ctx->str_root_top -= count;
+    if (ctx->str_root_top < 0) {
+        ctx->str_root_top = 0;
+    }
+}
+
+/* Does this value's body live in the string space? */
+static int in_string_space(struct interp *ctx, struct value *v)
+{
+    return v->type == VAL_STR && v->len > 0 &&
+           v->u.str >= ctx->str_space && v->u.str < ctx->str_space + STRING_SPACE;
+}
+
+/* qsort() order for collect_garbage(): by body address, then by
+ * descriptor so that duplicate roots end up adjacent. */
+static int compare_roots(const void *a, const void *b)
+{
+    struct value *va, *vb;
+    va = *(struct value * const *)a;
+    vb = *(struct value * const *)b;
+    if (va->u.str != vb->u.str) {
+        return va->u.str < vb->u.str ? -1 : 1;
+    }
+    if (va != vb) {
+        return va < vb ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Gather every descriptor that points into the string space: scalar and
+ * array string variables, the registered temporaries and the evaluation
+ * stack.  Returns the count; `list' may be NULL to count only. */
+static int gather_string_roots(struct interp *ctx, struct value **list)
+{
+    int i, j, n;
+    n = 0;
+    for (i = 0; i < ctx->var_count; i++) {
+        if (!ctx->vars[i].is_string) {
+            continue;
+        }
+        if (in_string_space(ctx, &ctx->vars[i].scalar)) {
+            if (list) list[n] = &ctx->vars[i].scalar;
+            n++;
+        }
+        if (ctx->vars[i].is_array) {
+            for (j = 0; j < ctx->vars[i].size; j++) {
+                if (in_string_space(ctx, &ctx->vars[i].str_array[j])) {
+                    if (list) list[n] = &ctx->vars[i].str_array[j];
+                    n++;
+                }
+            }
+        }
+    }
+    for (i = 0; i < ctx->str_root_top; i++) {
+        if (in_string_space(ctx, ctx->str_roots[i])) {
+            if (list) list[n] = ctx->str_roots[i];
+            n++;
+        }
+    }
+    for (i = 0; i < ctx->eval_top; i++) {
+        if (in_string_space(ctx, &ctx->eval_stack[i])) {
+            if (list) list[n] = &ctx->eval_stack[i];
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Compact the string space.  Live descriptors are sorted by address and
+ * overlapping bodies (shared or substring strings) are merged into one
+ * run, which slides down as a unit with every descriptor in it adjusted
+ * by the same delta. */
+static void collect_garbage(struct interp *ctx)
+{
+    struct value **roots;
+    char *dest;
+    char *start;
+    char *end;
+    int n, i, j, k;
+    n = gather_string_roots(ctx, NULL);
+    if (n == 0) {
+        ctx->str_top = ctx->str_space;
+        return;
+    }
+    roots = (struct value **)malloc(n * sizeof(struct value *));
+    if (!roots) {
+        runtime_error(ctx, "Out of memory");
+        return;
+    }
+    gather_string_roots(ctx, roots);
+    qsort(roots, n, sizeof(struct value *), compare_roots);
+    dest = ctx->str_space;
+    i = 0;
+    while (i < n) {
+        start = roots[i]->u.str;
+        end = start + roots[i]->len;
+        j = i + 1;
+        while (j < n && roots[j]->u.str <= end) {
+            if (roots[j]->u.str + roots[j]->len > end) {
+                end = roots[j]->u.str + roots[j]->len;
+            }
+            j++;
+        }
+        if (dest != start) {
+            memmove(dest, start, end - start);
+        }
+        for (k = i; k < j; k++) {
+            if (k == i || roots[k] != roots[k - 1]) {
+                roots[k]->u.str -= start - dest;
+            }
+        }
+        dest += end - start;
+        i = j;
+    }
+    ctx->str_top = dest;
+    free(roots);
+}
+
+/* Reserve `len' bytes of string space, collecting garbage if it is full.
+ * Any string held in a C local across this call must be protected. */
+static char *str_alloc(struct interp *ctx, int len)
+{
+    if (len > ctx->str_space + STRING_SPACE - ctx->str_top) {
+        collect_garbage(ctx);
+        if (len > ctx->str_space + STRING_SPACE - ctx->str_top) {
+            runtime_error(ctx, "Out of string space");
+            return NULL;
+        }
+    }
+    ctx->str_top += len;
+    ctx->stat_str_bytes += len;
+    if (ctx->str_top - ctx->str_space > ctx->stat_str_peak) {
+        ctx->stat_str_peak = ctx->str_top - ctx->str_space;
+    }
+    return ctx->str_top - len;
+}
+
+/* Build the concatenation a + b.  Both operands are protected while the
+ * result is allocated.  When `a' is the most recent allocation the result
+ * simply extends it in place, so A$ = A$ + X$ loops stay linear. */
+static struct value concat_str(struct interp *ctx, struct value *a, struct value *b)
+{
+    char *buf;
+    int len;
+    if (b->len == 0) {
+        return *a;
+    }
+    if (a->len == 0) {
+        return *b;
+    }
+    len = a->len + b->len;
+    if (in_string_space(ctx, a) && a->u.str + a->len == ctx->str_top &&
+        b->len <= ctx->str_space + STRING_SPACE - ctx->str_top) {
+        buf = ctx->str_top;
+        ctx->str_top += b->len;
+        ctx->stat_str_bytes += b->len;
+        if (ctx->str_top - ctx->str_space > ctx->stat_str_peak) {
+            ctx->stat_str_peak = ctx->str_top - ctx->str_space;
+        }
+        memmove(buf, b->u.str, b->len);
+        return make_str_ref(a->u.str, len);
+    }
+    str_protect(ctx, a);
+    str_protect(ctx, b);
+    buf = str_alloc(ctx, len);
+    str_unprotect(ctx, 2);
+    if (!buf) {
+        return make_str_ref((char *)"", 0);
+    }
+    memcpy(buf, a->u.str, a->len);
+    memcpy(buf + a->len, b->u.str, b->len);
+    return make_str_ref(buf, len);
+}
+
+/* A substring of `src': a view of the same bytes, since string bodies
+ * never change once written.  The collector keeps just the part of a
+ * body that some descriptor still covers. */
+static struct value make_substr(struct value *src, int start, int len)
+{
+    if (len <= 0) {
+        return make_str_ref((char *)"", 0);
+    }
+    return make_str_ref(src->u.str + start, len);
+}
+
+/* Compare two strings byte by byte; a proper prefix sorts first. */
+static int compare_str(struct value *a, struct value *b)
+{
+    int n, r;
+    n = a->len < b->len ? a->len : b->len;
+    r = memcmp(a->u.str, b->u.str, n);
+    if (r != 0) {
+        return r;
+    }
+    return a->len - b->len;
+}
+
+/* Copy a string value into a NUL-terminated buffer for the C library. */
+static void str_to_cstr(struct value *v, char *buf, int size)
+{
+    int len;
+    len = v->len < size - 1 ? v->len : size - 1;
+    memcpy(buf, v->u.str, len);
+    buf[len] = '\0';
+}
+
+/* Ensure the value is a VAL_NUM, promoting integers, or raise a runtime
+ * error. */
+static void ensure_num(struct interp *ctx, struct value *v)
+{
+    if (v->type == VAL_INT) {
+        double d;
+        d = (double)v->u.ival;
+        v->type = VAL_NUM;
+        v->u.num = d;
+    } else if (v->type != VAL_NUM) {
+        runtime_error(ctx, "Numeric value required");
+    }
+}
+
+/* Are both operands integers?  If not, both are promoted to VAL_NUM. */
+static int both_int(struct interp *ctx, struct value *a, struct value *b)
+{
+    if (a->type == VAL_INT && b->type == VAL_INT) {
+        return 1;
+    }
+    ensure_num(ctx, a);
+    ensure_num(ctx, b);
+    return 0;
+}
+
+/* Convert a number for an integer variable, truncating toward minus
+ * infinity as INT() does. */
+static int num_to_intvar(struct interp *ctx, struct value *v, int *out)
+{
+    double d;
+    if (v->type == VAL_INT) {
+        *out = v->u.ival;
+        return 1;
+    }
+    ensure_num(ctx, v);
+    d = floor(v->u.num);
+    if (d < MIN_INTVAR || d > MAX_INTVAR) {
+        runtime_error(ctx, "Illegal quantity");
+        return 0;
+    }
+    *out = (int)d;
+    return 1;
+}
+
+/* Ensure the value is string or raise a runtime error. */
+static void ensure_str(struct interp *ctx, struct value *v)
+{
+    if (v->type != VAL_STR) {
+        runtime_error(ctx, "String value required");
+    }
+}
+
+/* Emit spaces and track current print column. */
+static void print_spaces(struct interp *ctx, int count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        out_char(ctx, ' ');
+        ctx->print_col++;
+        if (ctx->print_col >= PRINT_WIDTH) {
+            out_char(ctx, '\n');
+            ctx->print_col = 0;
+        }
+    }
+}
+
+/* Emit a value (number or string) updating column tracking. */
+static void print_value(struct interp *ctx, struct value *v)
+{
+    if (v->type == VAL_STR) {
+        char *s;
+        int n;
+        s = v->u.str;
+        for (n = v->len; n > 0; n--) {
+            out_char(ctx, *s);
+            if (*s == '\n') {
+                ctx->print_col = 0;
+            } else {
+                ctx->print_col++;
+                if (ctx->print_col >= PRINT_WIDTH) {
+                    out_char(ctx, '\n');
+                    ctx->print_col = 0;
+                }
+            }
+            s++;
+        }
+    } else {
+        char buf[64];
+        int n;
+        if (v->type == VAL_INT) {
+            n = format_int(v->u.ival, buf);
+        } else {
+            n = format_number(v->u.num, buf);
+        }
+        out_bytes(ctx, buf, n);
+        ctx->print_col += n;
+    }
+}
+
+/* Read the jiffy clock. */
+static unsigned long jiffies(void)
+{
+    struct tms t;
+    return (unsigned long)((double)(times(&t) - clock_origin) * JIFFIES_PER_SEC / clock_rate);
+}
+
+/* Sleep for a number of 60Hz ticks, using the best timer available. */
+static void do_sleep_ticks(double ticks)
+{
+    long usec;
+    unsigned int sec;
+#ifndef HAVE_USLEEP
+    struct timeval tv;
+#endif
+    if (ticks <= 0.0) {
+        return;
+    }
+    usec = (long)(ticks * (1000000.0 / JIFFIES_PER_SEC) + 0.5);
+    if (usec <= 0) {
+        return;
+    }
+    sec = (unsigned int)(usec / 1000000L);
+    usec = usec % 1000000L;
+#ifdef HAVE_USLEEP
+    if (sec > 0) {
+        sleep(sec);
+    }
+    if (usec > 0) {
+        usleep((unsigned int)usec);
+    }
+#else
+    /* No usleep; use select() for sub-second delay if available */
+    if (sec > 0) {
+        sleep(sec);
+    }
+    if (usec > 0) {
+        tv.tv_sec = 0;
+        tv.tv_usec = usec;
+        select(0, (fd_set *)0, (fd_set *)0, (fd_set *)0, &tv);
+    }
+#endif
+}
+
+/* Parse SLEEP statement and pause execution, or in sleep_yield mode
+ * only note when to resume. */
+static void statement_sleep(struct interp *ctx, unsigned char **p)
+{
+    struct value v;
+    v = eval_expression(ctx, p);
+    ensure_num(ctx, &v);
+    out_flush(ctx);
+    if (ctx->sleep_yield) {
+        if (v.u.num > 0.0) {
+            ctx->wake_time = jiffies() + (unsigned long)(v.u.num + 0.5);
+            ctx->sleeping = 1;
+        }
+        return;
+    }
+    do_sleep_ticks(v.u.num);
+}
+
+/* Advance the RND generator and return its next value in [0, 1).  Plain
+ * 32-bit unsigned long arithmetic, so it is the same on the PDP-11. */
+static double rnd_next(struct interp *ctx)
+{
+    unsigned long x;
+    x = ctx->rnd_state;
+    x ^= (x << 13) & 0xffffffffUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xffffffffUL;
+    ctx->rnd_state = x;
+    return (double)x / 4294967296.0;
+}
+
+/* Restart the RND sequence from a seed derived from every byte of `d',
+ * so the same negative argument always gives the same sequence. */
+static void rnd_seed(struct interp *ctx, double d)
+{
+    unsigned char bytes[sizeof(double)];
+    unsigned long h;
+    int i;
+    memcpy(bytes, &d, sizeof(double));
+    h = 2166136261UL;
+    for (i = 0; i < (int)sizeof(double); i++) {
+        h = ((h ^ bytes[i]) * 16777619UL) & 0xffffffffUL;
+    }
+    ctx->rnd_state = h ? h : RND_SEED;
+}
+
+/* Jiffies since midnight by TI$. */
+static unsigned long time_of_day(struct interp *ctx)
+{
+    return (jiffies() % JIFFIES_PER_DAY + ctx->clock_offset) % JIFFIES_PER_DAY;
+}
+
+/* Value of TI, or of TI$ as "HHMMSS". */
+static struct value clock_value(struct interp *ctx, int tok)
+{
+    unsigned long t;
+    char buf[6];
+    int i;
+    t = time_of_day(ctx);
+    if (tok == TOK_TI) {
+        return make_num((double)t);
+    }
+    t /= JIFFIES_PER_SEC;
+    t = t / 3600 * 10000 + t / 60 % 60 * 100 + t % 60;
+    for (i = 5; i >= 0; i--) {
+        buf[i] = (char)('0' + t % 10);
+        t /= 10;
+    }
+    return make_str_len(ctx, buf, 6);
+}
+
+/* Parse TI$ = "HHMMSS", setting the time of day. */
+static void statement_set_clock(struct interp *ctx, unsigned char **p)
+{
+    struct value v;
+    unsigned long secs;
+    int i;
+    if (**p != '=') {
+        runtime_error(ctx, "Expected '='");
+        return;
+    }
+    (*p)++;
+    v = eval_expression(ctx, p);
+    if (ctx->halted) {
+        return;
+    }
+    ensure_str(ctx, &v);
+    if (ctx->halted) {
+        return;
+    }
+    for (i = 0; i < v.len && isdigit((unsigned char)v.u.str[i]); i++) {
+        ;
+    }
+    if (v.len != 6 || i != 6 || (v.u.str[0] - '0') * 10 + v.u.str[1] - '0' > 23 ||
+        v.u.str[2] > '5' || v.u.str[4] > '5') {
+        runtime_error(ctx, "Illegal quantity");
+        return;
+    }
+    secs = 0;
+    for (i = 0; i < 6; i += 2) {
+        secs = secs * 60 + (v.u.str[i] - '0') * 10 + v.u.str[i + 1] - '0';
+    }
+    ctx->clock_offset = (secs * JIFFIES_PER_SEC + JIFFIES_PER_DAY - jiffies() % JIFFIES_PER_DAY) %
+                        JIFFIES_PER_DAY;
+}
+
+/* Counter `which' of the run statistics, numbered as in basic.h. */
+static double stat_value(struct interp *ctx, int which)
+{
+    switch (which) {
+    case BASIC_STAT_STATEMENTS:
+        return (double)ctx->stat_statements;
+    case BASIC_STAT_GOTOS:
+        return (double)ctx->stat_gotos;
+    case BASIC_STAT_GOSUBS:
+        return (double)ctx->stat_gosubs;
+    case BASIC_STAT_VARS:
+        return (double)ctx->stat_vars;
+    case BASIC_STAT_RESIZES:
+        return (double)ctx->stat_resizes;
+    case BASIC_STAT_STR_BYTES:
+        return (double)ctx->stat_str_bytes;
+    case BASIC_STAT_STR_PEAK:
+        return (double)ctx->stat_str_peak;
+    case BASIC_STAT_FOR_PEAK:
+        return (double)ctx->stat_for_peak;
+    case BASIC_STAT_GOSUB_PEAK:
+        return (double)ctx->stat_gosub_peak;
+    case BASIC_STAT_SECONDS:
+        return (double)((ctx->running ? jiffies() : ctx->stat_end) - ctx->stat_start) / JIFFIES_PER_SEC;
+    }
+    return 0.0;
+}
+
+/* Apply an intrinsic function to its `nargs' evaluated arguments.  The
+ * arguments stay on the evaluation stack, so they are GC roots. */
+static struct value call_function(struct interp *ctx, int func, struct value *args, int nargs)
+{
+    struct value arg;
     char outbuf[MAX_STR_LEN];
 
-    /* Advance past function name */
-    read_identifier(p, tmp, sizeof(tmp));
-    skip_spaces(p);
-    if (**p != '(') {
-        runtime_error("Function requires '('");
+    if (func == TOK_TI || func == TOK_TI_S) {
+        return clock_value(ctx, func);
+    }
+    if (func < TOK_LEFT_S && nargs != 1) {
+        runtime_error(ctx, "Missing ')'");
         return make_num(0.0);
     }
-    (*p)++;
-    arg = eval_or_expr(p);
-    skip_spaces(p);
-
-    /* Single-argument functions - consume closing paren here */
-    if (name_equals(name, "SIN")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        return make_num(sin(arg.num));
-    }
-    if (name_equals(name, "COS")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        return make_num(cos(arg.num));
-    }
-    if (name_equals(name, "TAN")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        return make_num(tan(arg.num));
-    }
-    if (name_equals(name, "ATN")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        return make_num(atan(arg.num));
-    }
-    if (name_equals(name, "ABS")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        return make_num(fabs(arg.num));
-    }
-    if (name_equals(name, "INT")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        return make_num(floor(arg.num));
-    }
-    if (name_equals(name, "SQR")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        return make_num(sqrt(arg.num));
-    }
-    if (name_equals(name, "SGN")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        if (arg.num > 0) {
+    arg = args[0];
+
+    switch (func) {
+    /* Single-argument functions */
+    case TOK_SIN:
+        ensure_num(ctx, &arg);
+        return make_num(sin(arg.u.num));
+    case TOK_COS:
+        ensure_num(ctx, &arg);
+        return make_num(cos(arg.u.num));
+    case TOK_TAN:
+        ensure_num(ctx, &arg);
+        return make_num(tan(arg.u.num));
+    case TOK_ATN:
+        ensure_num(ctx, &arg);
+        return make_num(atan(arg.u.num));
+    case TOK_ABS:
+        ensure_num(ctx, &arg);
+        return make_num(fabs(arg.u.num));
+    case TOK_INT:
+        ensure_num(ctx, &arg);
+        return make_num(floor(arg.u.num));
+    case TOK_SQR:
+        ensure_num(ctx, &arg);
+        return make_num(sqrt(arg.u.num));
+    case TOK_SGN:
+        ensure_num(ctx, &arg);
+        if (arg.u.num > 0) {
             return make_num(1.0);
-        } else if (arg.num < 0) {
+        } else if (arg.u.num < 0) {
             return make_num(-1.0);
         } else {
             return make_num(0.0);
         }
-    }
-    if (name_equals(name, "EXP")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        return make_num(exp(arg.num));
-    }
-    if (name_equals(name, "LOG")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        return make_num(log(arg.num));
-    }
-    if (name_equals(name, "RND")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        if (arg.num < 0) {
-            srand((unsigned int)(-arg.num));
-        }
-        return make_num((double)rand() / (double)RAND_MAX);
-    }
-    if (name_equals(name, "LEN")) {
-        if (**p == ')') (*p)++;
-        ensure_str(&arg);
-        return make_num((double)strlen(arg.str));
-    }
-    if (name_equals(name, "VAL")) {
-        if (**p == ')') (*p)++;
-        ensure_str(&arg);
-        return make_num(atof(arg.str));
-    }
-    if (name_equals(name, "STR$")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        sprintf(outbuf, "%g", arg.num);
-        return make_str(outbuf);
-    }
-    if (name_equals(name, "CHR$")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        outbuf[0] = (char)((int)arg.num & 0xff);
-        outbuf[1] = '\0';
-        return make_str(outbuf);
-    }
-    if (name_equals(name, "ASC")) {
-        if (**p == ')') (*p)++;
-        ensure_str(&arg);
-        if (arg.str[0] == '\0') {
+    case TOK_EXP:
+        ensure_num(ctx, &arg);
+        return make_num(exp(arg.u.num));
+    case TOK_LOG:
+        ensure_num(ctx, &arg);
+        return make_num(log(arg.u.num));
+    case TOK_RND:
+        /* As in CBM BASIC: negative reseeds, 0 draws on the clock and
+         * positive continues the sequence */
+        ensure_num(ctx, &arg);
+        if (arg.u.num < 0) {
+            rnd_seed(ctx, arg.u.num);
+        } else if (arg.u.num == 0) {
+            ctx->rnd_state ^= ((unsigned long)time(NULL) ^ ((unsigned long)clock() << 12)) & 0xffffffffUL;
+            if (ctx->rnd_state == 0) {
+                ctx->rnd_state = RND_SEED;
+            }
+        }
+        return make_num(rnd_next(ctx));
+    case TOK_LEN:
+        ensure_str(ctx, &arg);
+        return make_num((double)arg.len);
+    case TOK_VAL:
+        ensure_str(ctx, &arg);
+        str_to_cstr(&arg, outbuf, sizeof(outbuf));
+        return make_num(text_to_num(outbuf));
+    case TOK_STR_S:
+        ensure_num(ctx, &arg);
+        return make_str_len(ctx, outbuf, format_number(arg.u.num, outbuf));
+    case TOK_CHR_S:
+        ensure_num(ctx, &arg);
+        return make_str_ref(chr_table + ((int)arg.u.num & 0xff), 1);
+    case TOK_ASC:
+        ensure_str(ctx, &arg);
+        if (arg.len == 0) {
             return make_num(0.0);
         }
-        return make_num((unsigned char)arg.str[0]);
-    }
-    if (name_equals(name, "NOT")) {
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        return make_num((double)(~(int)arg.num));
-    }
-    if (name_equals(name, "FRE")) {
-        if (**p == ')') (*p)++;
-        /* Return a plausible free memory value */
-        return make_num(32768.0);
-    }
-    if (name_equals(name, "POS")) {
-        if (**p == ')') (*p)++;
+        return make_num((unsigned char)arg.u.str[0]);
+    case TOK_NOT:
+        ensure_num(ctx, &arg);
+        return make_num((double)(~(int)arg.u.num));
+    case TOK_FRE:
+        /* Free string space, after compacting it as CBM BASIC does */
+        collect_garbage(ctx);
+        return make_num((double)(ctx->str_space + STRING_SPACE - ctx->str_top));
+    case TOK_STAT:
+        ensure_num(ctx, &arg);
+        if (arg.u.num < 0 || arg.u.num >= BASIC_STAT_COUNT) {
+            runtime_error(ctx, "Illegal quantity");
+            return make_num(0.0);
+        }
+        return make_num(stat_value(ctx, (int)arg.u.num));
+    case TOK_POS:
         /* Return current print column (1-indexed for BASIC) */
-        return make_num((double)(print_col + 1));
-    }
-    if (name_equals(name, "TAB")) {
+        return make_num((double)(ctx->print_col + 1));
+    case TOK_TAB: {
         int target;
         int cur;
         int width;
-        if (**p == ')') (*p)++;
-        ensure_num(&arg);
-        target = (int)arg.num;
+        ensure_num(ctx, &arg);
+        target = (int)arg.u.num;
         width = PRINT_WIDTH;
         if (width <= 0) {
             width = 80;
@@ -561,1212 +1915,4151 @@ static struct value eval_function(const char *name, char **p)
         if (target < 0) {
             target += width;
         }
-        cur = print_col;
+        cur = ctx->print_col;
         if (target < cur) {
-            fputc('\n', stdout);
+            out_char(ctx, '\n');
             cur = 0;
         }
         while (cur < target) {
-            fputc(' ', stdout);
+            out_char(ctx, ' ');
             cur++;
         }
-        print_col = cur;
-        return make_str("");
+        ctx->print_col = cur;
+        return make_str(ctx, "");
     }
 
     /* Multi-argument string functions */
 
     /* LEFT$(string, length) - return leftmost characters */
-    if (name_equals(name, "LEFT$")) {
+    case TOK_LEFT_S: {
         struct value len_val;
         int len, slen;
-        ensure_str(&arg);
-        skip_spaces(p);
-        if (**p != ',') {
-            runtime_error("LEFT$ requires two arguments");
-            return make_str("");
-        }
-        (*p)++;
-        len_val = eval_or_expr(p);
-        ensure_num(&len_val);
-        skip_spaces(p);
-        if (**p == ')') {
-            (*p)++;
+        if (nargs != 2) {
+            runtime_error(ctx, "LEFT$ requires two arguments");
+            return make_str(ctx, "");
         }
-        len = (int)len_val.num;
-        slen = strlen(arg.str);
+        ensure_str(ctx, &arg);
+        len_val = args[1];
+        ensure_num(ctx, &len_val);
+        len = (int)len_val.u.num;
+        slen = arg.len;
         if (len < 0) len = 0;
         if (len > slen) len = slen;
-        strncpy(outbuf, arg.str, len);
-        outbuf[len] = '\0';
-        return make_str(outbuf);
+        return make_substr(&arg, 0, len);
     }
 
     /* RIGHT$(string, length) - return rightmost characters */
-    if (name_equals(name, "RIGHT$")) {
+    case TOK_RIGHT_S: {
         struct value len_val;
         int len, slen, start;
-        ensure_str(&arg);
-        skip_spaces(p);
-        if (**p != ',') {
-            runtime_error("RIGHT$ requires two arguments");
-            return make_str("");
-        }
-        (*p)++;
-        len_val = eval_or_expr(p);
-        ensure_num(&len_val);
-        skip_spaces(p);
-        if (**p == ')') {
-            (*p)++;
+        if (nargs != 2) {
+            runtime_error(ctx, "RIGHT$ requires two arguments");
+            return make_str(ctx, "");
         }
-        len = (int)len_val.num;
-        slen = strlen(arg.str);
+        ensure_str(ctx, &arg);
+        len_val = args[1];
+        ensure_num(ctx, &len_val);
+        len = (int)len_val.u.num;
+        slen = arg.len;
         if (len < 0) len = 0;
         if (len > slen) len = slen;
         start = slen - len;
-        strcpy(outbuf, arg.str + start);
-        return make_str(outbuf);
+        return make_substr(&arg, start, len);
     }
 
     /* MID$(string, start [, length]) - return substring */
-    if (name_equals(name, "MID$")) {
+    case TOK_MID_S: {
         struct value start_val, len_val;
         int start, len, slen;
-        ensure_str(&arg);
-        skip_spaces(p);
-        if (**p != ',') {
-            runtime_error("MID$ requires at least two arguments");
-            return make_str("");
+        if (nargs < 2 || nargs > 3) {
+            runtime_error(ctx, "MID$ requires two or three arguments");
+            return make_str(ctx, "");
         }
-        (*p)++;
-        start_val = eval_or_expr(p);
-        ensure_num(&start_val);
-        start = (int)start_val.num;
-        skip_spaces(p);
-        slen = strlen(arg.str);
-        if (**p == ',') {
-            (*p)++;
-            len_val = eval_or_expr(p);
-            ensure_num(&len_val);
-            len = (int)len_val.num;
+        ensure_str(ctx, &arg);
+        start_val = args[1];
+        ensure_num(ctx, &start_val);
+        start = (int)start_val.u.num;
+        if (nargs == 3) {
+            len_val = args[2];
+            ensure_num(ctx, &len_val);
+            len = (int)len_val.u.num;
         } else {
-            len = slen;  /* Rest of string */
-        }
-        skip_spaces(p);
-        if (**p == ')') {
-            (*p)++;
+            len = arg.len;  /* Rest of string */
         }
+        slen = arg.len;
         /* BASIC strings are 1-indexed */
         if (start < 1) start = 1;
         start--;  /* Convert to 0-indexed */
         if (start >= slen) {
-            return make_str("");
+            return make_str(ctx, "");
         }
         if (len < 0) len = 0;
         if (start + len > slen) len = slen - start;
-        strncpy(outbuf, arg.str + start, len);
-        outbuf[len] = '\0';
-        return make_str(outbuf);
+        return make_substr(&arg, start, len);
     }
 
     /* INSTR(haystack, needle) - find substring position */
-    if (name_equals(name, "INSTR")) {
+    case TOK_INSTR: {
         struct value needle_val;
-        char *found;
         int offset;
-        ensure_str(&arg);
-        skip_spaces(p);
-        if (**p != ',') {
-            runtime_error("INSTR requires two arguments");
+        if (nargs != 2) {
+            runtime_error(ctx, "INSTR requires two arguments");
             return make_num(0.0);
         }
+        ensure_str(ctx, &arg);
+        needle_val = args[1];
+        ensure_str(ctx, &needle_val);
+        for (offset = 0; offset + needle_val.len <= arg.len; offset++) {
+            if (memcmp(arg.u.str + offset, needle_val.u.str, needle_val.len) == 0) {
+                return make_num((double)(offset + 1));  /* 1-indexed */
+            }
+        }
+        return make_num(0.0);
+    }
+    }
+
+    runtime_error(ctx, "Unknown function");
+    return make_num(0.0);
+}
+
+/* Position of a variable name in var_slot_table.  Real, string and
+ * integer variables of the same name are distinct. */
+static int var_name_key(char name1, char name2, int type)
+{
+    int code2;
+    if (name2 >= 'A' && name2 <= 'Z') {
+        code2 = name2 - 'A' + 1;
+    } else if (name2 >= '0' && name2 <= '9') {
+        code2 = name2 - '0' + 27;
+    } else {
+        code2 = 0;
+    }
+    return ((name1 - 'A') * VAR_NAME2_CODES + code2) * 3 + type;
+}
+
+/* Return the variable with this name, creating it on first sight.  Only
+ * the cruncher and the embedding API call this; at run time variables
+ * are reached by slot. */
+static struct var *find_or_create_var(struct interp *ctx, char name1, char name2, int type)
+{
+    int key;
+    struct var *v;
+    key = var_name_key(name1, name2, type);
+    if (ctx->var_slot_table[key]) {
+        return &ctx->vars[ctx->var_slot_table[key] - 1];
+    }
+    if (ctx->var_count >= MAX_VARS) {
+        runtime_error(ctx, "Variable table full");
+        return NULL;
+    }
+    v = &ctx->vars[ctx->var_count++];
+    ctx->var_slot_table[key] = (unsigned char)ctx->var_count;
+    ctx->stat_vars++;
+    v->name1 = name1;
+    v->name2 = name2;
+    v->is_string = type == VAL_STR;
+    v->is_int = type == VAL_INT;
+    v->is_array = 0;
+    v->size = 0;
+    v->ndims = 0;
+    v->num_array = NULL;
+    v->int_array = NULL;
+    v->str_array = NULL;
+    v->scalar = make_num(0.0);
+    if (type == VAL_STR) {
+        v->scalar = make_str(ctx, "");
+    } else if (type == VAL_INT) {
+        v->scalar = make_int(0);
+    }
+    return v;
+}
+
+/* Give a variable array storage of at least `size' elements, keeping any
+ * existing contents.  New numeric elements are zero, new strings empty. */
+static int dim_array(struct interp *ctx, struct var *v, int size)
+{
+    int i;
+    if (v->is_array && size <= v->size) {
+        return 1;
+    }
+    if (v->is_string) {
+        struct value *grown;
+        grown = (struct value *)realloc(v->str_array, size * sizeof(struct value));
+        if (!grown) {
+            runtime_error(ctx, "Out of memory");
+            return 0;
+        }
+        for (i = v->size; i < size; i++) {
+            grown[i] = make_str_ref((char *)"", 0);
+        }
+        v->str_array = grown;
+    } else if (v->is_int) {
+        int *grown;
+        grown = (int *)realloc(v->int_array, size * sizeof(int));
+        if (!grown) {
+            runtime_error(ctx, "Out of memory");
+            return 0;
+        }
+        for (i = v->size; i < size; i++) {
+            grown[i] = 0;
+        }
+        v->int_array = grown;
+    } else {
+        double *grown;
+        grown = (double *)realloc(v->num_array, size * sizeof(double));
+        if (!grown) {
+            runtime_error(ctx, "Out of memory");
+            return 0;
+        }
+        for (i = v->size; i < size; i++) {
+            grown[i] = 0.0;
+        }
+        v->num_array = grown;
+    }
+    v->size = size;
+    v->is_array = 1;
+    ctx->stat_resizes++;
+    if (v->ndims <= 1) {
+        v->ndims = 1;
+        v->extent[0] = size;
+        v->stride[0] = 1;
+    }
+    return 1;
+}
+
+/* Dimension an array with `ndims' subscripts of the given extents.  A
+ * one-dimensional array may be grown later; other shapes are fixed. */
+static int dim_shape(struct interp *ctx, struct var *v, int ndims, int *extent)
+{
+    long total;
+    int i;
+    if (v->is_array) {
+        if (v->ndims != ndims) {
+            runtime_error(ctx, "Redim'd array");
+            return 0;
+        }
+        if (ndims == 1) {
+            return dim_array(ctx, v, extent[0]);
+        }
+        for (i = 0; i < ndims; i++) {
+            if (v->extent[i] != extent[i]) {
+                runtime_error(ctx, "Redim'd array");
+                return 0;
+            }
+        }
+        return 1;
+    }
+    total = 1;
+    for (i = ndims - 1; i >= 0; i--) {
+        v->extent[i] = extent[i];
+        v->stride[i] = (int)total;
+        total *= extent[i];
+        if (total > (long)((unsigned)~0 >> 1) / (long)sizeof(struct value)) {
+            runtime_error(ctx, "Array too large");
+            return 0;
+        }
+    }
+    v->ndims = ndims;
+    return dim_array(ctx, v, (int)total);
+}
+
+/* Step over a parenthesised subscript list without evaluating it. */
+static void skip_subscripts(unsigned char **p)
+{
+    int depth;
+    if (**p != '(') {
+        return;
+    }
+    depth = 0;
+    while (**p) {
+        if (**p == '(') {
+            depth++;
+        } else if (**p == ')') {
+            depth--;
+            if (depth == 0) {
+                (*p)++;
+                return;
+            }
+        }
+        *p = skip_token(*p);
+    }
+}
+
+/* Resolve an element of array `v' from `nsubs' evaluated subscripts.  An
+ * array used before any DIM gets DEFAULT_ARRAY_SIZE elements per
+ * subscript, as in CBM BASIC; subscripts past the end are an error unless
+ * -g is in effect, which grows one-dimensional arrays instead. */
+static int element_ref(struct interp *ctx, struct var *v, struct value *sub, int nsubs, struct lvalue *lv)
+{
+    int array_index;
+    int subs[MAX_DIMS];
+    int k;
+
+    if (nsubs > MAX_DIMS) {
+        runtime_error(ctx, "Too many subscripts");
+        return 0;
+    }
+    for (k = 0; k < nsubs; k++) {
+        if (sub[k].type == VAL_INT) {
+            subs[k] = sub[k].u.ival;
+        } else {
+            ensure_num(ctx, &sub[k]);
+            subs[k] = (int)(sub[k].u.num + 0.00001);
+        }
+        if (subs[k] < 0) {
+            runtime_error(ctx, "Negative array index");
+            return 0;
+        }
+    }
+    if (!v->is_array) {
+        int extent[MAX_DIMS];
+        for (k = 0; k < nsubs; k++) {
+            extent[k] = DEFAULT_ARRAY_SIZE;
+        }
+        if (!dim_shape(ctx, v, nsubs, extent)) {
+            return 0;
+        }
+    }
+    if (nsubs != v->ndims) {
+        runtime_error(ctx, "Bad subscript");
+        return 0;
+    }
+    if (nsubs == 1) {
+        array_index = subs[0];
+        if (array_index >= v->size) {
+            if (!ctx->array_autogrow) {
+                runtime_error(ctx, "Bad subscript");
+                return 0;
+            }
+            if (!dim_array(ctx, v, array_index + 1)) {
+                return 0;
+            }
+        }
+    } else {
+        array_index = 0;
+        for (k = 0; k < nsubs; k++) {
+            if (subs[k] >= v->extent[k]) {
+                runtime_error(ctx, "Bad subscript");
+                return 0;
+            }
+            array_index += subs[k] * v->stride[k];
+        }
+    }
+    lv->is_string = v->is_string;
+    lv->is_int = v->is_int;
+    lv->is_array = 1;
+    lv->num = v->num_array ? &v->num_array[array_index] : NULL;
+    lv->ival = v->int_array ? &v->int_array[array_index] : NULL;
+    lv->str = v->str_array ? &v->str_array[array_index] : NULL;
+    return 1;
+}
+
+/* Resolve a variable (and optional subscripts) to its storage. */
+static int get_var_reference(struct interp *ctx, unsigned char **p, struct lvalue *lv)
+{
+    struct var *v;
+    struct value subs[MAX_DIMS];
+    int nsubs;
+
+    if (**p != TOK_VAR) {
+        runtime_error(ctx, "Expected variable");
+        return 0;
+    }
+    v = &ctx->vars[get_u16(*p + 1)];
+    *p += 3;
+    if (**p != '(') {
+        lv->is_string = v->is_string;
+        lv->is_int = v->is_int;
+        lv->is_array = 0;
+        lv->num = &v->scalar.u.num;
+        lv->ival = &v->scalar.u.ival;
+        lv->str = &v->scalar;
+        return 1;
+    }
+    (*p)++;
+    nsubs = 0;
+    for (;;) {
+        if (nsubs >= MAX_DIMS) {
+            runtime_error(ctx, "Too many subscripts");
+            return 0;
+        }
+        subs[nsubs++] = eval_expression(ctx, p);
+        if (ctx->halted) {
+            return 0;
+        }
+        if (**p != ',') {
+            break;
+        }
         (*p)++;
-        needle_val = eval_or_expr(p);
-        ensure_str(&needle_val);
-        skip_spaces(p);
-        if (**p == ')') {
-            (*p)++;
+    }
+    if (**p != ')') {
+        runtime_error(ctx, "Missing ')'");
+        return 0;
+    }
+    (*p)++;
+    return element_ref(ctx, v, subs, nsubs, lv);
+}
+
+/* Give `v' array storage if it has never been dimensioned, as any use of
+ * an element would. */
+static int mat_storage(struct interp *ctx, struct var *v)
+{
+    int extent[1];
+    if (v->is_array) {
+        return 1;
+    }
+    extent[0] = DEFAULT_ARRAY_SIZE;
+    return dim_shape(ctx, v, 1, extent);
+}
+
+/* Numeric element `i' of a real or integer array. */
+static double mat_get(struct var *v, int i)
+{
+    return v->is_int ? (double)v->int_array[i] : v->num_array[i];
+}
+
+/* Store into numeric element `i', rounding down for integer arrays. */
+static int mat_put(struct interp *ctx, struct var *v, int i, double d)
+{
+    if (v->is_int) {
+        d = floor(d);
+        if (d < MIN_INTVAR || d > MAX_INTVAR) {
+            runtime_error(ctx, "Illegal quantity");
+            return 0;
+        }
+        v->int_array[i] = (int)d;
+    } else {
+        v->num_array[i] = d;
+    }
+    return 1;
+}
+
+/* SUM(A), DOT(A, B) and FIND(A, x), each one loop over the elements in
+ * storage order.  FIND gives the index of the first element equal to x,
+ * counting in that order, or -1. */
+static struct value array_function(struct interp *ctx, int func, struct var *a, struct var *b, struct value *x)
+{
+    double total;
+    double d;
+    int i;
+    if (!mat_storage(ctx, a) || (func == TOK_DOT && !mat_storage(ctx, b))) {
+        return make_num(0.0);
+    }
+    if (a->is_string && func != TOK_FIND) {
+        runtime_error(ctx, "Type mismatch");
+        return make_num(0.0);
+    }
+    switch (func) {
+    case TOK_SUM:
+        total = 0.0;
+        if (a->is_int) {
+            for (i = 0; i < a->size; i++) {
+                total += a->int_array[i];
+            }
+        } else {
+            for (i = 0; i < a->size; i++) {
+                total += a->num_array[i];
+            }
+        }
+        return make_num(total);
+    case TOK_DOT:
+        if (b->is_string) {
+            runtime_error(ctx, "Type mismatch");
+            return make_num(0.0);
+        }
+        if (a->size != b->size) {
+            runtime_error(ctx, "Dimension mismatch");
+            return make_num(0.0);
+        }
+        total = 0.0;
+        if (!a->is_int && !b->is_int) {
+            for (i = 0; i < a->size; i++) {
+                total += a->num_array[i] * b->num_array[i];
+            }
+        } else {
+            for (i = 0; i < a->size; i++) {
+                total += mat_get(a, i) * mat_get(b, i);
+            }
+        }
+        return make_num(total);
+    default:
+        if (a->is_string) {
+            ensure_str(ctx, x);
+            for (i = 0; !ctx->halted && i < a->size; i++) {
+                if (compare_str(&a->str_array[i], x) == 0) {
+                    return make_long(i);
+                }
+            }
+            return make_int(-1);
+        }
+        if (x->type == VAL_INT) {
+            d = x->u.ival;
+        } else {
+            ensure_num(ctx, x);
+            d = x->u.num;
+        }
+        for (i = 0; !ctx->halted && i < a->size; i++) {
+            if (mat_get(a, i) == d) {
+                return make_long(i);
+            }
+        }
+        return make_int(-1);
+    }
+}
+
+/* Messages for OP_ERROR, in the order of the CX_ codes */
+static const char *const compile_errors[] = {
+    "Syntax error in expression",
+    "Missing ')'",
+    "Function requires '('",
+    "Expression too complex",
+    "Too many subscripts",
+    "Array name expected"
+};
+
+#define CX_SYNTAX 0
+#define CX_PAREN 1
+#define CX_FUNC_PAREN 2
+#define CX_COMPLEX 3
+#define CX_SUBSCRIPTS 4
+#define CX_ARRAY 5
+
+/* Apply a comparison operator, giving -1 for true and 0 for false. */
+static struct value compare_values(struct interp *ctx, int op, struct value *a, struct value *b)
+{
+    int r;
+    if ((a->type == VAL_STR || b->type == VAL_STR) && op != OP_LE && op != OP_GE) {
+        ensure_str(ctx, a);
+        ensure_str(ctx, b);
+        if (ctx->halted) {
+            return make_int(0);
+        }
+        r = compare_str(a, b);
+        switch (op) {
+        case OP_EQ: return make_int(r == 0 ? -1 : 0);
+        case OP_NE: return make_int(r != 0 ? -1 : 0);
+        case OP_LT: return make_int(r < 0 ? -1 : 0);
+        default:    return make_int(r > 0 ? -1 : 0);
+        }
+    }
+    if (both_int(ctx, a, b)) {
+        switch (op) {
+        case OP_EQ: return make_int(a->u.ival == b->u.ival ? -1 : 0);
+        case OP_NE: return make_int(a->u.ival != b->u.ival ? -1 : 0);
+        case OP_LT: return make_int(a->u.ival < b->u.ival ? -1 : 0);
+        case OP_GT: return make_int(a->u.ival > b->u.ival ? -1 : 0);
+        case OP_LE: return make_int(a->u.ival <= b->u.ival ? -1 : 0);
+        default:    return make_int(a->u.ival >= b->u.ival ? -1 : 0);
         }
-        found = strstr(arg.str, needle_val.str);
-        if (found) {
-            offset = found - arg.str + 1;  /* 1-indexed */
-            return make_num((double)offset);
+    }
+    switch (op) {
+    case OP_EQ: return make_int(a->u.num == b->u.num ? -1 : 0);
+    case OP_NE: return make_int(a->u.num != b->u.num ? -1 : 0);
+    case OP_LT: return make_int(a->u.num < b->u.num ? -1 : 0);
+    case OP_GT: return make_int(a->u.num > b->u.num ? -1 : 0);
+    case OP_LE: return make_int(a->u.num <= b->u.num ? -1 : 0);
+    default:    return make_int(a->u.num >= b->u.num ? -1 : 0);
+    }
+}
+
+/* Run the compiled expression in [pc, end) on the evaluation stack and
+ * return its value.  eval_top is brought up to date before any step that
+ * can allocate string space, since the collector scans the stack. */
+static struct value run_expr(struct interp *ctx, unsigned char *pc, unsigned char *end)
+{
+    struct value *base;
+    struct value *sp;
+    struct value *a;
+    struct value *b;
+    struct lvalue lv;
+    int n;
+
+    base = &ctx->eval_stack[ctx->eval_top];
+    sp = base;
+    while (pc < end && !ctx->halted) {
+        switch (*pc++) {
+        case OP_INUM:
+            *sp++ = make_int(get_s16(pc));
+            pc += 2;
+            break;
+        case OP_NUM:
+            *sp++ = make_num(get_num_operand(pc));
+            pc += sizeof(double);
+            break;
+        case OP_STR:
+            n = get_u16(pc);
+            *sp++ = make_str_ref((char *)pc + 2, n);
+            pc += 2 + n;
+            break;
+        case OP_VAR:
+            *sp++ = ctx->vars[get_u16(pc)].scalar;
+            pc += 2;
+            break;
+        case OP_ELEM:
+            n = pc[2];
+            sp -= n;
+            if (!element_ref(ctx, &ctx->vars[get_u16(pc)], sp, n, &lv)) {
+                break;
+            }
+            if (lv.is_string) {
+                *sp = *lv.str;
+            } else if (lv.is_int) {
+                *sp = make_int(*lv.ival);
+            } else {
+                *sp = make_num(*lv.num);
+            }
+            sp++;
+            pc += 3;
+            break;
+        case OP_FUNC:
+            n = pc[1];
+            ctx->eval_top = sp - ctx->eval_stack;
+            sp -= n;
+            *sp = call_function(ctx, pc[0], sp, n);
+            sp++;
+            pc += 2;
+            break;
+        case OP_NEG:
+            a = sp - 1;
+            if (a->type == VAL_INT) {
+                *a = make_long(-(long)a->u.ival);
+            } else {
+                ensure_num(ctx, a);
+                a->u.num = -a->u.num;
+            }
+            break;
+        case OP_POS:
+            if (sp[-1].type != VAL_INT) {
+                ensure_num(ctx, sp - 1);
+            }
+            break;
+        case OP_POW:
+            b = --sp;
+            a = sp - 1;
+            ensure_num(ctx, a);
+            ensure_num(ctx, b);
+            a->u.num = pow(a->u.num, b->u.num);
+            break;
+        case OP_MUL:
+            b = --sp;
+            a = sp - 1;
+            if (both_int(ctx, a, b)) {
+                *a = make_long((long)a->u.ival * b->u.ival);
+            } else {
+                a->u.num *= b->u.num;
+            }
+            break;
+        case OP_DIV:
+            b = --sp;
+            a = sp - 1;
+            if (both_int(ctx, a, b)) {
+                /* Division stays integral only when it is exact.  It is
+                 * done in long, as -32768 / -1 overflows an int. */
+                if (b->u.ival != 0 && (long)a->u.ival % b->u.ival == 0) {
+                    *a = make_long((long)a->u.ival / b->u.ival);
+                    break;
+                }
+                ensure_num(ctx, a);
+                ensure_num(ctx, b);
+            }
+            a->u.num /= b->u.num;
+            break;
+        case OP_ADD:
+            b = --sp;
+            a = sp - 1;
+            if (a->type == VAL_STR || b->type == VAL_STR) {
+                ensure_str(ctx, a);
+                ensure_str(ctx, b);
+                ctx->eval_top = sp + 1 - ctx->eval_stack;
+                *a = concat_str(ctx, a, b);
+            } else if (both_int(ctx, a, b)) {
+                *a = make_long((long)a->u.ival + b->u.ival);
+            } else {
+                a->u.num += b->u.num;
+            }
+            break;
+        case OP_SUB:
+            b = --sp;
+            a = sp - 1;
+            if (both_int(ctx, a, b)) {
+                *a = make_long((long)a->u.ival - b->u.ival);
+            } else {
+                a->u.num -= b->u.num;
+            }
+            break;
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_GT:
+        case OP_LE:
+        case OP_GE:
+            b = --sp;
+            a = sp - 1;
+            *a = compare_values(ctx, pc[-1], a, b);
+            break;
+        case OP_AND:
+            b = --sp;
+            a = sp - 1;
+            if (both_int(ctx, a, b)) {
+                a->u.ival &= b->u.ival;
+            } else {
+                *a = make_long((long)a->u.num & (long)b->u.num);
+            }
+            break;
+        case OP_OR:
+            b = --sp;
+            a = sp - 1;
+            if (both_int(ctx, a, b)) {
+                a->u.ival |= b->u.ival;
+            } else {
+                *a = make_long((long)a->u.num | (long)b->u.num);
+            }
+            break;
+        case OP_AFUNC:
+            if (pc[0] == TOK_FIND) {
+                sp[-1] = array_function(ctx, TOK_FIND, &ctx->vars[get_u16(pc + 1)], NULL, sp - 1);
+            } else {
+                *sp = array_function(ctx, pc[0], &ctx->vars[get_u16(pc + 1)],
+                                     &ctx->vars[get_u16(pc + 3)], NULL);
+                sp++;
+            }
+            pc += 5;
+            break;
+        case OP_ERROR:
+            runtime_error(ctx, compile_errors[*pc]);
+            break;
+        default:
+            runtime_error(ctx, "Syntax error in expression");
+            break;
         }
+    }
+    ctx->eval_top = base - ctx->eval_stack;
+    if (ctx->halted || sp != base + 1) {
+        return make_num(0.0);
+    }
+    return *base;
+}
+
+/* Evaluate the compiled expression at *p and step past it. */
+static struct value eval_expression(struct interp *ctx, unsigned char **p)
+{
+    unsigned char *ops;
+    if (**p != TOK_EXPR) {
+        runtime_error(ctx, "Syntax error in expression");
         return make_num(0.0);
     }
-
-    runtime_error("Unknown function");
-    return make_num(0.0);
+    ops = *p + 3;
+    *p = ops + get_u16(*p + 1);
+    return run_expr(ctx, ops, *p);
+}
+
+/* State of the expression compiler while it rewrites one crunched line. */
+struct compiler {
+    unsigned char *r;           /* next crunched token */
+    struct codebuf *cb;         /* compiled line */
+    int error;                  /* CX_ code of the first error, or -1 */
+    int depth;                  /* evaluation stack depth at this point */
+    int max_depth;
+    int open_ifs[MAX_LINE_IFS]; /* operand offsets of unmatched IFs */
+    int if_count;
+    int failed;                 /* the line cannot be loaded */
+};
+
+static int cx_or(struct interp *ctx, struct compiler *c);
+
+/* Copy one crunched token unchanged. */
+static void cx_copy(struct interp *ctx, struct compiler *c)
+{
+    unsigned char *next;
+    next = skip_token(c->r);
+    emit_bytes(ctx, c->cb, c->r, next - c->r);
+    c->r = next;
+}
+
+/* Copy tokens unchanged up to the end of the statement.  An IF starts a
+ * statement of its own, so the caller compiles it. */
+static void cx_copy_rest(struct interp *ctx, struct compiler *c)
+{
+    while (!at_statement_end(c->r) && *c->r != TOK_IF) {
+        cx_copy(ctx, c);
+    }
+}
+
+/* Emit an operation with a 16-bit operand. */
+static void cx_emit_u16(struct interp *ctx, struct compiler *c, int op, unsigned v)
+{
+    emit_byte(ctx, c->cb, op);
+    emit_byte(ctx, c->cb, v & 0xff);
+    emit_byte(ctx, c->cb, (v >> 8) & 0xff);
+}
+
+/* Account for `n' values pushed (or popped, if negative). */
+static void cx_push(struct compiler *c, int n)
+{
+    c->depth += n;
+    if (c->depth > c->max_depth) {
+        c->max_depth = c->depth;
+    }
+}
+
+/* Record the first error of an expression. */
+static void cx_error(struct compiler *c, int code)
+{
+    if (c->error < 0) {
+        c->error = code;
+    }
+}
+
+/* Evaluate the constant operations emitted since `start' and replace them
+ * with their value.  Only numbers are folded; anything that fails, such
+ * as "A" * 2, is left to report its error when it runs. */
+static int cx_fold(struct interp *ctx, struct compiler *c, int start)
+{
+    struct value v;
+    const char *error;
+    int halted;
+    int failed;
+    if (c->error >= 0) {
+        return 0;
+    }
+    /* A failed fold must not clear an error reported before it */
+    halted = ctx->halted;
+    error = ctx->error;
+    ctx->halted = 0;
+    ctx->folding = 1;
+    v = run_expr(ctx, c->cb->data + start, c->cb->data + c->cb->len);
+    ctx->folding = 0;
+    failed = ctx->halted;
+    ctx->halted = halted;
+    ctx->error = error;
+    if (failed) {
+        return 0;
+    }
+    if (v.type == VAL_STR) {
+        return 0;
+    }
+    c->cb->len = start;
+    if (v.type == VAL_INT) {
+        cx_emit_u16(ctx, c, OP_INUM, (unsigned)v.u.ival & 0xffff);
+    } else {
+        emit_byte(ctx, c->cb, OP_NUM);
+        emit_bytes(ctx, c->cb, &v.u.num, sizeof(double));
+    }
+    return 1;
+}
+
+/* Emit a binary operation on the two values below it, folding it when
+ * both were constant. */
+static int cx_binary(struct interp *ctx, struct compiler *c, int op, int start, int constant)
+{
+    emit_byte(ctx, c->cb, op);
+    cx_push(c, -1);
+    return constant && cx_fold(ctx, c, start);
+}
+
+/* Functions whose result depends on more than their arguments */
+static int impure_function(int tok)
+{
+    return tok == TOK_RND || tok == TOK_FRE || tok == TOK_POS || tok == TOK_TAB ||
+           tok == TOK_STAT;
+}
+
+/* Compile an array name argument, without subscripts. */
+static int cx_array_name(struct compiler *c, unsigned *slot)
+{
+    if (*c->r != TOK_VAR || c->r[3] == '(') {
+        cx_error(c, CX_ARRAY);
+        return 0;
+    }
+    *slot = get_u16(c->r + 1);
+    c->r += 3;
+    return 1;
+}
+
+/* SUM(A), DOT(A, B) or FIND(A, expr): array names become operands of
+ * OP_AFUNC, and FIND's value is on the stack. */
+static int cx_array_function(struct interp *ctx, struct compiler *c, int tok)
+{
+    unsigned a;
+    unsigned b;
+    c->r++;
+    if (*c->r != '(') {
+        cx_error(c, CX_FUNC_PAREN);
+        return 0;
+    }
+    c->r++;
+    b = 0;
+    if (!cx_array_name(c, &a)) {
+        return 0;
+    }
+    if (tok != TOK_SUM) {
+        if (*c->r != ',') {
+            cx_error(c, CX_SYNTAX);
+            return 0;
+        }
+        c->r++;
+        if (tok == TOK_DOT) {
+            if (!cx_array_name(c, &b)) {
+                return 0;
+            }
+        } else {
+            cx_or(ctx, c);
+            if (c->error >= 0) {
+                return 0;
+            }
+            cx_push(c, -1);
+        }
+    }
+    if (*c->r != ')') {
+        cx_error(c, CX_PAREN);
+        return 0;
+    }
+    c->r++;
+    emit_byte(ctx, c->cb, OP_AFUNC);
+    emit_byte(ctx, c->cb, tok);
+    emit_byte(ctx, c->cb, a & 0xff);
+    emit_byte(ctx, c->cb, (a >> 8) & 0xff);
+    emit_byte(ctx, c->cb, b & 0xff);
+    emit_byte(ctx, c->cb, (b >> 8) & 0xff);
+    cx_push(c, 1);
+    return 0;
+}
+
+/* factor: constant, variable, element, function call, (expr) or a unary
+ * sign applied to a factor.  Each compile function returns whether the
+ * code it emitted is constant. */
+static int cx_factor(struct interp *ctx, struct compiler *c)
+{
+    int start;
+    int tok;
+    int n;
+    int k;
+    start = c->cb->len;
+    tok = *c->r;
+    if (tok == '(') {
+        c->r++;
+        k = cx_or(ctx, c);
+        if (*c->r != ')') {
+            cx_error(c, CX_PAREN);
+            return 0;
+        }
+        c->r++;
+        return k;
+    }
+    if (tok == TOK_INUM) {
+        cx_emit_u16(ctx, c, OP_INUM, get_u16(c->r + 1));
+        c->r += 3;
+        cx_push(c, 1);
+        return 1;
+    }
+    if (tok == TOK_NUM) {
+        emit_byte(ctx, c->cb, OP_NUM);
+        emit_bytes(ctx, c->cb, c->r + 1, sizeof(double));
+        c->r += 1 + sizeof(double);
+        cx_push(c, 1);
+        return 1;
+    }
+    if (tok == TOK_STR) {
+        n = get_u16(c->r + 1);
+        cx_emit_u16(ctx, c, OP_STR, n);
+        emit_bytes(ctx, c->cb, c->r + 3, n);
+        c->r += 3 + n;
+        cx_push(c, 1);
+        return 1;
+    }
+    if (tok == TOK_VAR) {
+        unsigned slot;
+        slot = get_u16(c->r + 1);
+        c->r += 3;
+        if (*c->r != '(') {
+            cx_emit_u16(ctx, c, OP_VAR, slot);
+            cx_push(c, 1);
+            return 0;
+        }
+        c->r++;
+        n = 0;
+        for (;;) {
+            cx_or(ctx, c);
+            n++;
+            if (c->error >= 0 || *c->r != ',') {
+                break;
+            }
+            c->r++;
+        }
+        if (*c->r != ')') {
+            cx_error(c, CX_PAREN);
+            return 0;
+        }
+        c->r++;
+        if (n > MAX_DIMS) {
+            cx_error(c, CX_SUBSCRIPTS);
+            return 0;
+        }
+        cx_emit_u16(ctx, c, OP_ELEM, slot);
+        emit_byte(ctx, c->cb, n);
+        cx_push(c, 1 - n);
+        return 0;
+    }
+    if (tok == TOK_TI || tok == TOK_TI_S) {
+        /* The clock: a call without arguments, never constant */
+        c->r++;
+        emit_byte(ctx, c->cb, OP_FUNC);
+        emit_byte(ctx, c->cb, tok);
+        emit_byte(ctx, c->cb, 0);
+        cx_push(c, 1);
+        return 0;
+    }
+    if (tok >= TOK_FIRST_ARRAY_FUNC && tok <= TOK_LAST_FUNC) {
+        return cx_array_function(ctx, c, tok);
+    }
+    if (tok >= TOK_FIRST_FUNC && tok <= TOK_LAST_FUNC) {
+        c->r++;
+        if (*c->r != '(') {
+            cx_error(c, CX_FUNC_PAREN);
+            return 0;
+        }
+        c->r++;
+        n = 0;
+        k = 1;
+        for (;;) {
+            k = cx_or(ctx, c) && k;
+            n++;
+            if (c->error >= 0 || *c->r != ',') {
+                break;
+            }
+            c->r++;
+        }
+        if (*c->r != ')') {
+            cx_error(c, CX_PAREN);
+            return 0;
+        }
+        c->r++;
+        if (n > 255) {
+            cx_error(c, CX_COMPLEX);
+            return 0;
+        }
+        emit_byte(ctx, c->cb, OP_FUNC);
+        emit_byte(ctx, c->cb, tok);
+        emit_byte(ctx, c->cb, n);
+        cx_push(c, 1 - n);
+        return k && !impure_function(tok) && cx_fold(ctx, c, start);
+    }
+    if (tok == '+' || tok == '-') {
+        c->r++;
+        k = cx_factor(ctx, c);
+        emit_byte(ctx, c->cb, tok == '-' ? OP_NEG : OP_POS);
+        return k && cx_fold(ctx, c, start);
+    }
+    cx_error(c, CX_SYNTAX);
+    return 0;
+}
+
+/* power: factor [^ power], right-associative */
+static int cx_power(struct interp *ctx, struct compiler *c)
+{
+    int start;
+    int k;
+    start = c->cb->len;
+    k = cx_factor(ctx, c);
+    if (c->error < 0 && *c->r == '^') {
+        c->r++;
+        k = cx_power(ctx, c) && k;
+        k = cx_binary(ctx, c, OP_POW, start, k);
+    }
+    return k;
+}
+
+/* term: power {(* | /) power} */
+static int cx_term(struct interp *ctx, struct compiler *c)
+{
+    int start;
+    int k;
+    int op;
+    start = c->cb->len;
+    k = cx_power(ctx, c);
+    while (c->error < 0 && (*c->r == '*' || *c->r == '/')) {
+        op = *c->r++ == '*' ? OP_MUL : OP_DIV;
+        k = cx_power(ctx, c) && k;
+        k = cx_binary(ctx, c, op, start, k);
+    }
+    return k;
+}
+
+/* sum: term {(+ | -) term} */
+static int cx_sum(struct interp *ctx, struct compiler *c)
+{
+    int start;
+    int k;
+    int op;
+    start = c->cb->len;
+    k = cx_term(ctx, c);
+    while (c->error < 0 && (*c->r == '+' || *c->r == '-')) {
+        op = *c->r++ == '+' ? OP_ADD : OP_SUB;
+        k = cx_term(ctx, c) && k;
+        k = cx_binary(ctx, c, op, start, k);
+    }
+    return k;
+}
+
+/* comparison: sum [relop sum].  Only one comparison is taken, as before;
+ * a second one is left for the caller to reject. */
+static int cx_comparison(struct interp *ctx, struct compiler *c)
+{
+    int start;
+    int k;
+    int op;
+    start = c->cb->len;
+    k = cx_sum(ctx, c);
+    if (c->error >= 0) {
+        return 0;
+    }
+    if (c->r[0] == '<' && c->r[1] == '>') {
+        op = OP_NE;
+        c->r += 2;
+    } else if (c->r[0] == '<' && c->r[1] == '=') {
+        op = OP_LE;
+        c->r += 2;
+    } else if (c->r[0] == '>' && c->r[1] == '=') {
+        op = OP_GE;
+        c->r += 2;
+    } else if (c->r[0] == '<') {
+        op = OP_LT;
+        c->r++;
+    } else if (c->r[0] == '>') {
+        op = OP_GT;
+        c->r++;
+    } else if (c->r[0] == '=') {
+        op = OP_EQ;
+        c->r++;
+    } else {
+        return k;
+    }
+    k = cx_sum(ctx, c) && k;
+    return cx_binary(ctx, c, op, start, k);
+}
+
+/* and: comparison {AND comparison} */
+static int cx_and(struct interp *ctx, struct compiler *c)
+{
+    int start;
+    int k;
+    start = c->cb->len;
+    k = cx_comparison(ctx, c);
+    while (c->error < 0 && *c->r == TOK_AND) {
+        c->r++;
+        k = cx_comparison(ctx, c) && k;
+        k = cx_binary(ctx, c, OP_AND, start, k);
+    }
+    return k;
+}
+
+/* or: and {OR and}, the lowest precedence */
+static int cx_or(struct interp *ctx, struct compiler *c)
+{
+    int start;
+    int k;
+    start = c->cb->len;
+    k = cx_and(ctx, c);
+    while (c->error < 0 && *c->r == TOK_OR) {
+        c->r++;
+        k = cx_and(ctx, c) && k;
+        k = cx_binary(ctx, c, OP_OR, start, k);
+    }
+    return k;
+}
+
+/* Compile the expression at c->r into a TOK_EXPR block.  A malformed
+ * expression becomes a block that raises its error when it runs, and the
+ * rest of the statement is copied as it is; returns 0 in that case. */
+static int compile_expression(struct interp *ctx, struct compiler *c)
+{
+    int start;
+    start = c->cb->len;
+    cx_emit_u16(ctx, c, TOK_EXPR, 0);
+    c->error = -1;
+    c->depth = 0;
+    c->max_depth = 0;
+    cx_or(ctx, c);
+    if (c->error < 0 && c->max_depth > EVAL_STACK) {
+        c->error = CX_COMPLEX;
+    }
+    if (c->error >= 0) {
+        c->cb->len = start + 3;
+        emit_byte(ctx, c->cb, OP_ERROR);
+        emit_byte(ctx, c->cb, c->error);
+    }
+    put_u16(c->cb->data + start + 1, c->cb->len - (start + 3));
+    if (c->error >= 0) {
+        cx_copy_rest(ctx, c);
+        return 0;
+    }
+    return 1;
+}
+
+/* Compile a variable reference, with any subscripts, to be assigned. */
+static int compile_lvalue(struct interp *ctx, struct compiler *c)
+{
+    if (*c->r != TOK_VAR) {
+        return 1;               /* reported when it runs */
+    }
+    cx_copy(ctx, c);
+    if (*c->r != '(') {
+        return 1;
+    }
+    cx_copy(ctx, c);
+    for (;;) {
+        if (!compile_expression(ctx, c)) {
+            return 0;
+        }
+        if (*c->r != ',') {
+            break;
+        }
+        cx_copy(ctx, c);
+    }
+    if (*c->r == ')') {
+        cx_copy(ctx, c);
+    }
+    return 1;
+}
+
+/* Compile a list of variables separated by commas (INPUT, READ). */
+static void compile_lvalue_list(struct interp *ctx, struct compiler *c)
+{
+    for (;;) {
+        if (!compile_lvalue(ctx, c)) {
+            return;
+        }
+        if (*c->r != ',') {
+            return;
+        }
+        cx_copy(ctx, c);
+    }
+}
+
+/* Compile ON expr GOTO|GOSUB line[, line...] and record the size of its
+ * table, which stays 0 unless the list is well formed. */
+static void compile_on(struct interp *ctx, struct compiler *c)
+{
+    int at;
+    int count;
+    cx_copy(ctx, c);
+    at = c->cb->len - 2;
+    if (!compile_expression(ctx, c)) {
+        return;
+    }
+    if (*c->r == TOK_GOTO || *c->r == TOK_GOSUB) {
+        cx_copy(ctx, c);
+        count = 0;
+        while (*c->r == TOK_LINE) {
+            cx_copy(ctx, c);
+            count++;
+            if (*c->r != ',') {
+                if (at_statement_end(c->r)) {
+                    put_u16(c->cb->data + at, count);
+                }
+                break;
+            }
+            cx_copy(ctx, c);
+        }
+    }
+    cx_copy_rest(ctx, c);
+}
+
+/* Compile the statement at c->r.  Statements without expressions, and
+ * whatever follows a part that does not parse, are copied unchanged for
+ * execute_statement() to deal with. */
+static void compile_statement(struct interp *ctx, struct compiler *c)
+{
+    switch (*c->r) {
+    case TOK_LET:
+        cx_copy(ctx, c);
+        if (*c->r == TOK_TI_S) {
+            compile_statement(ctx, c);
+            return;
+        }
+        /* fall through */
+    case TOK_VAR:
+        if (compile_lvalue(ctx, c) && *c->r == '=') {
+            cx_copy(ctx, c);
+            compile_expression(ctx, c);
+        }
+        return;
+    case TOK_TI_S:
+        cx_copy(ctx, c);
+        if (*c->r == '=') {
+            cx_copy(ctx, c);
+            compile_expression(ctx, c);
+        }
+        return;
+    case TOK_PRINT:
+        cx_copy(ctx, c);
+        while (!at_statement_end(c->r)) {
+            if (!compile_expression(ctx, c)) {
+                return;
+            }
+            if (*c->r != ';' && *c->r != ',') {
+                return;
+            }
+            cx_copy(ctx, c);
+        }
+        return;
+    case TOK_INPUT:
+        cx_copy(ctx, c);
+        if (*c->r == TOK_STR) {
+            cx_copy(ctx, c);
+            if (*c->r == ';' || *c->r == ',') {
+                cx_copy(ctx, c);
+            }
+        }
+        compile_lvalue_list(ctx, c);
+        return;
+    case TOK_READ:
+        cx_copy(ctx, c);
+        compile_lvalue_list(ctx, c);
+        return;
+    case TOK_IF:
+        if (c->if_count >= MAX_LINE_IFS) {
+            runtime_error(ctx, "Too many IFs on one line");
+            c->failed = 1;
+            return;
+        }
+        cx_copy(ctx, c);
+        c->open_ifs[c->if_count++] = c->cb->len - 2;
+        if (compile_expression(ctx, c) && *c->r == TOK_THEN) {
+            cx_copy(ctx, c);
+            if (*c->r == TOK_LINE) {
+                cx_copy(ctx, c);
+            }
+        }
+        return;
+    case TOK_ELSE:
+        /* ELSE belongs to the innermost open IF */
+        if (c->if_count == 0) {
+            runtime_error(ctx, "ELSE without IF");
+            c->failed = 1;
+            return;
+        }
+        cx_copy(ctx, c);
+        c->if_count--;
+        put_u16(c->cb->data + c->open_ifs[c->if_count],
+                c->cb->len - (c->open_ifs[c->if_count] + 2));
+        if (*c->r == TOK_LINE) {
+            cx_copy(ctx, c);
+        }
+        return;
+    case TOK_FOR:
+        cx_copy(ctx, c);
+        if (!compile_lvalue(ctx, c) || *c->r != '=') {
+            return;
+        }
+        cx_copy(ctx, c);
+        if (!compile_expression(ctx, c) || *c->r != TOK_TO) {
+            return;
+        }
+        cx_copy(ctx, c);
+        if (!compile_expression(ctx, c) || *c->r != TOK_STEP) {
+            return;
+        }
+        cx_copy(ctx, c);
+        compile_expression(ctx, c);
+        return;
+    case TOK_DIM:
+        cx_copy(ctx, c);
+        while (*c->r == TOK_VAR) {
+            if (!compile_lvalue(ctx, c) || *c->r != ',') {
+                return;
+            }
+            cx_copy(ctx, c);
+        }
+        return;
+    case TOK_SLEEP:
+        cx_copy(ctx, c);
+        compile_expression(ctx, c);
+        return;
+    case TOK_ON:
+        compile_on(ctx, c);
+        return;
+    case TOK_MAT:
+        /* Only the scalar in MAT A = (x) [* B] is an expression */
+        cx_copy(ctx, c);
+        if (*c->r == TOK_VAR) {
+            cx_copy(ctx, c);
+        }
+        if (*c->r == '=') {
+            cx_copy(ctx, c);
+        }
+        if (*c->r == '(') {
+            cx_copy(ctx, c);
+            if (!compile_expression(ctx, c)) {
+                return;
+            }
+        }
+        cx_copy_rest(ctx, c);
+        return;
+    }
+    cx_copy(ctx, c);
+    cx_copy_rest(ctx, c);
+}
+
+/* Rewrite a crunched line with every expression compiled, and fill in
+ * the IF skips.  Returns the code in compile_buf, or NULL if the line
+ * cannot be loaded. */
+static struct codebuf *compile_line(struct interp *ctx, struct codebuf *src)
+{
+    struct compiler c;
+    c.r = src->data;
+    c.cb = &ctx->compile_buf;
+    c.cb->len = 0;
+    c.if_count = 0;
+    c.failed = 0;
+    while (*c.r && !c.failed && !ctx->halted) {
+        if (*c.r == ':') {
+            cx_copy(ctx, &c);
+            continue;
+        }
+        compile_statement(ctx, &c);
+    }
+    if (c.failed || !emit_byte(ctx, c.cb, 0)) {
+        return NULL;
+    }
+    while (c.if_count > 0) {
+        c.if_count--;
+        put_u16(c.cb->data + c.open_ifs[c.if_count],
+                c.cb->len - 1 - (c.open_ifs[c.if_count] + 2));
+    }
+    return c.cb;
+}
+
+/* Evaluate an IF condition: true when non-zero or a non-empty string. */
+static int eval_condition(struct interp *ctx, unsigned char **p)
+{
+    struct value result;
+    result = eval_expression(ctx, p);
+    if (result.type == VAL_STR) {
+        return result.len > 0;
+    }
+    if (result.type == VAL_INT) {
+        return result.u.ival != 0;
+    }
+    return result.u.num != 0.0;
+}
+
+/* Skip rest of line (REM or ' comment). */
+static void statement_rem(unsigned char **p)
+{
+    skip_to_eol(p);
+}
+
+static void statement_print(struct interp *ctx, unsigned char **p)
+{
+    int newline;
+    struct value v;
+    newline = 1;
+    for (;;) {
+        if (at_statement_end(*p)) {
+            break;
+        }
+        v = eval_expression(ctx, p);
+        if (ctx->halted) {
+            return;
+        }
+        print_value(ctx, &v);
+        if (**p == ';') {
+            newline = 0;
+            (*p)++;
+        } else if (**p == ',') {
+            newline = 0;
+            {
+                int zone;
+                int nextcol;
+                zone = 10;
+                nextcol = ((ctx->print_col / zone) + 1) * zone;
+                if (nextcol < ctx->print_col) {
+                    nextcol = ctx->print_col;
+                }
+                print_spaces(ctx, nextcol - ctx->print_col);
+            }
+            (*p)++;
+        } else {
+            newline = 1;
+            break;
+        }
+    }
+    if (newline) {
+        out_char(ctx, '\n');
+        ctx->print_col = 0;
+    }
+    if (ctx->out_interactive) {
+        out_flush(ctx);
+    }
+}
+
+/* Read one line of program input, without its line ending, through
+ * in_buf.  Overlong lines are truncated.  Returns 0 at end of input. */
+static int read_input_line(struct interp *ctx, char *buf, int size)
+{
+    int n;
+    int got;
+    int c;
+    n = 0;
+    got = 0;
+    for (;;) {
+        if (ctx->in_pos >= ctx->in_len) {
+            ctx->in_len = read(ctx->in_fd, ctx->in_buf, INPUT_BUFFER);
+            ctx->in_pos = 0;
+            if (ctx->in_len <= 0) {
+                ctx->in_len = 0;
+                break;
+            }
+        }
+        got = 1;
+        c = ctx->in_buf[ctx->in_pos++];
+        if (c == '\n') {
+            break;
+        }
+        if (n < size - 1) {
+            buf[n++] = (char)c;
+        }
+    }
+    if (n > 0 && buf[n - 1] == '\r') {
+        n--;
+    }
+    buf[n] = '\0';
+    return got;
+}
+
+/* Copy the next comma-separated INPUT value at `s' into `field'.  Leading
+ * spaces are dropped and a quoted value may contain commas.  Returns the
+ * start of the following value, or NULL when the line is used up. */
+static char *next_input_field(char *s, char *field, int size)
+{
+    int n;
+    n = 0;
+    while (*s == ' ') {
+        s++;
+    }
+    if (*s == '\"') {
+        s++;
+        while (*s && *s != '\"') {
+            if (n < size - 1) {
+                field[n++] = *s;
+            }
+            s++;
+        }
+        if (*s == '\"') {
+            s++;
+        }
+        while (*s && *s != ',') {
+            s++;
+        }
+    } else {
+        while (*s && *s != ',') {
+            if (n < size - 1) {
+                field[n++] = *s;
+            }
+            s++;
+        }
+    }
+    field[n] = '\0';
+    return *s == ',' ? s + 1 : NULL;
+}
+
+/* Parse INPUT ["prompt";] var[, var...].  As in CBM BASIC one line
+ * supplies as many comma-separated values as it holds; a short line is
+ * followed by a "??" request for the rest, and extra values are dropped.
+ * In batch mode the prompts are not printed. */
+static void statement_input(struct interp *ctx, unsigned char **p)
+{
+    struct value prompt;
+    char linebuf[MAX_LINE_LEN];
+    char field[MAX_LINE_LEN];
+    char *rest;
+    int first_prompt;
+    struct lvalue lv;
+
+    prompt = make_str_ref((char *)"", 0);
+    first_prompt = 1;
+    rest = NULL;
+    if (**p == TOK_STR) {
+        prompt = make_str_ref((char *)*p + 3, get_u16(*p + 1));
+        *p = skip_token(*p);
+        if (**p == ';' || **p == ',') {
+            (*p)++;
+        }
+    }
+    for (;;) {
+        if (at_statement_end(*p)) {
+            break;
+        }
+        if (**p != TOK_VAR) {
+            runtime_error(ctx, "Expected variable in INPUT");
+            return;
+        }
+        if (!get_var_reference(ctx, p, &lv)) {
+            return;
+        }
+        if (rest == NULL) {
+            if (!ctx->input_batch) {
+                if (first_prompt) {
+                    out_bytes(ctx, prompt.u.str, prompt.len);
+                    out_bytes(ctx, "? ", 2);
+                } else {
+                    out_bytes(ctx, "?? ", 3);
+                }
+            }
+            out_flush(ctx);
+            if (!read_input_line(ctx, linebuf, sizeof(linebuf))) {
+                runtime_error(ctx, "Unexpected end of input");
+                return;
+            }
+            rest = linebuf;
+            first_prompt = 0;
+        }
+        rest = next_input_field(rest, field, sizeof(field));
+        if (lv.is_string) {
+            *lv.str = make_str(ctx, field);
+        } else if (lv.is_int) {
+            struct value n;
+            n = make_num(text_to_num(field));
+            if (!num_to_intvar(ctx, &n, lv.ival)) {
+                return;
+            }
+        } else {
+            *lv.num = text_to_num(field);
+        }
+        if (**p == ',') {
+            (*p)++;
+            continue;
+        }
+        break;
+    }
+    if (rest != NULL && !ctx->input_batch) {
+        out_bytes(ctx, "?EXTRA IGNORED\n", 15);
+    }
+}
+
+static void statement_let(struct interp *ctx, unsigned char **p)
+{
+    struct lvalue lv;
+    struct value rhs;
+    unsigned char *target;
+
+    target = NULL;
+    if (ctx->array_autogrow && **p == TOK_VAR && (*p)[3] == '(') {
+        /* The right-hand side may grow this very array, so resolve the
+         * element only after it has been evaluated. */
+        target = *p;
+        *p += 3;
+        skip_subscripts(p);
+    } else if (!get_var_reference(ctx, p, &lv)) {
+        return;
+    }
+    if (**p != '=') {
+        runtime_error(ctx, "Expected '='");
+        return;
+    }
+    (*p)++;
+    rhs = eval_expression(ctx, p);
+    if (ctx->halted) {
+        return;
+    }
+    if (target) {
+        str_protect(ctx, &rhs);
+        if (!get_var_reference(ctx, &target, &lv)) {
+            str_unprotect(ctx, 1);
+            return;
+        }
+        str_unprotect(ctx, 1);
+    }
+    if (lv.is_string) {
+        ensure_str(ctx, &rhs);
+        if (rhs.type == VAL_STR) {
+            *lv.str = rhs;
+        }
+    } else if (lv.is_int) {
+        num_to_intvar(ctx, &rhs, lv.ival);
+    } else {
+        ensure_num(ctx, &rhs);
+        if (rhs.type == VAL_NUM) {
+            *lv.num = rhs.u.num;
+        }
+    }
+}
+
+/* Read the pre-resolved target of GOTO/GOSUB/THEN, or -1 if it is
+ * missing or names a line that does not exist. */
+static int read_line_target(unsigned char **p)
+{
+    unsigned index;
+    if (**p != TOK_LINE) {
+        return -1;
+    }
+    index = get_u16(*p + 3);
+    *p += 5;
+    if (index == NO_LINE) {
+        return -1;
+    }
+    return (int)index;
+}
+
+static void statement_goto(struct interp *ctx, unsigned char **p)
+{
+    ctx->stat_gotos++;
+    ctx->current_line = read_line_target(p);
+    if (ctx->current_line < 0) {
+        runtime_error(ctx, "Target line not found");
+        return;
+    }
+    ctx->statement_pos = NULL;
+}
+
+/* Push a GOSUB frame returning to `return_pos' in the current line,
+ * growing the stack in steps up to MAX_GOSUB frames. */
+static int gosub_push(struct interp *ctx, unsigned char *return_pos)
+{
+    if (ctx->gosub_top >= ctx->gosub_cap) {
+        struct gosub_frame *grown;
+        int cap;
+        if (ctx->gosub_cap >= MAX_GOSUB) {
+            runtime_error(ctx, "GOSUB stack overflow");
+            return 0;
+        }
+        cap = ctx->gosub_cap ? ctx->gosub_cap * 2 : GOSUB_CHUNK;
+        if (cap > MAX_GOSUB) {
+            cap = MAX_GOSUB;
+        }
+        grown = (struct gosub_frame *)realloc(ctx->gosub_stack, cap * sizeof(struct gosub_frame));
+        if (!grown) {
+            runtime_error(ctx, "Out of memory");
+            return 0;
+        }
+        ctx->gosub_stack = grown;
+        ctx->gosub_cap = cap;
+    }
+    ctx->gosub_stack[ctx->gosub_top].line_index = ctx->current_line;
+    ctx->gosub_stack[ctx->gosub_top].offset = (int)(return_pos - ctx->program_lines[ctx->current_line].code);
+    ctx->gosub_top++;
+    ctx->stat_gosubs++;
+    if (ctx->gosub_top > ctx->stat_gosub_peak) {
+        ctx->stat_gosub_peak = ctx->gosub_top;
+    }
+    return 1;
+}
+
+static void statement_gosub(struct interp *ctx, unsigned char **p)
+{
+    int target;
+
+    target = read_line_target(p);
+    if (target < 0) {
+        runtime_error(ctx, "Target line not found");
+        return;
+    }
+    if (!gosub_push(ctx, *p)) {
+        return;
+    }
+    ctx->current_line = target;
+    ctx->statement_pos = NULL;
+}
+
+static void statement_return(struct interp *ctx, unsigned char **p)
+{
+    (void)p;  /* Unused parameter */
+    if (ctx->gosub_top <= 0) {
+        runtime_error(ctx, "RETURN without GOSUB");
+        return;
+    }
+    ctx->gosub_top--;
+    ctx->current_line = ctx->gosub_stack[ctx->gosub_top].line_index;
+    ctx->statement_pos = ctx->program_lines[ctx->current_line].code + ctx->gosub_stack[ctx->gosub_top].offset;
+}
+
+/* Parse ON expr GOTO|GOSUB line[, line...].  A value of n selects the
+ * nth line straight from the table; 0 or more than the number of lines
+ * continues with the next statement, as in CBM BASIC. */
+static void statement_on(struct interp *ctx, unsigned char **p)
+{
+    struct value v;
+    unsigned char *entry;
+    int count;
+    int kind;
+    int n;
+    int target;
+
+    count = (int)get_u16(*p);
+    *p += 2;
+    v = eval_expression(ctx, p);
+    if (!num_to_intvar(ctx, &v, &n)) {
+        return;
+    }
+    kind = **p;
+    if (count == 0 || (kind != TOK_GOTO && kind != TOK_GOSUB)) {
+        runtime_error(ctx, "Syntax error in ON");
+        return;
+    }
+    if (n < 0) {
+        runtime_error(ctx, "Illegal quantity");
+        return;
+    }
+    if (n == 0 || n > count) {
+        *p += count * ON_ENTRY;
+        return;
+    }
+    entry = *p + 1 + (n - 1) * ON_ENTRY;
+    *p += count * ON_ENTRY;
+    target = read_line_target(&entry);
+    if (target < 0) {
+        runtime_error(ctx, "Target line not found");
+        return;
+    }
+    if (kind == TOK_GOSUB) {
+        if (!gosub_push(ctx, *p)) {
+            return;
+        }
+    } else {
+        ctx->stat_gotos++;
+    }
+    ctx->current_line = target;
+    ctx->statement_pos = NULL;
+}
+
+/* Parse READ var[, var...], taking the next items from the DATA pool. */
+static void statement_read(struct interp *ctx, unsigned char **p)
+{
+    struct lvalue lv;
+    struct data_item *item;
+    for (;;) {
+        if (!get_var_reference(ctx, p, &lv)) {
+            return;
+        }
+        if (ctx->data_next >= ctx->data_count) {
+            runtime_error(ctx, "Out of data");
+            return;
+        }
+        item = &ctx->data_pool[ctx->data_next++];
+        if (lv.is_string) {
+            *lv.str = item->text;
+        } else if (!item->is_num) {
+            runtime_error(ctx, "Syntax error in DATA");
+            return;
+        } else if (lv.is_int) {
+            if (!num_to_intvar(ctx, &item->num, lv.ival)) {
+                return;
+            }
+        } else {
+            *lv.num = item->num.type == VAL_INT ? (double)item->num.u.ival : item->num.u.num;
+        }
+        if (**p != ',') {
+            break;
+        }
+        (*p)++;
+    }
+}
+
+/* Parse RESTORE [line]: the next READ starts at the first item at or
+ * after that line, or at the first item of the program. */
+static void statement_restore(struct interp *ctx, unsigned char **p)
+{
+    int line;
+    if (**p != TOK_LINE) {
+        ctx->data_next = 0;
+        return;
+    }
+    line = read_line_target(p);
+    if (line < 0) {
+        runtime_error(ctx, "Target line not found");
+        return;
+    }
+    ctx->data_next = ctx->program_lines[line].data_index;
+}
+
+/* Parse IF cond THEN ... [ELSE ...].  A false condition resumes at the
+ * offset recorded by the cruncher, past the ELSE or at the end of line. */
+static void statement_if(struct interp *ctx, unsigned char **p)
+{
+    int cond_true;
+    unsigned char *skip_to;
+
+    skip_to = *p + 2 + get_u16(*p);
+    *p += 2;
+    cond_true = eval_condition(ctx, p);
+    if (**p != TOK_THEN) {
+        runtime_error(ctx, "Missing THEN");
+        return;
+    }
+    (*p)++;
+    if (!cond_true) {
+        *p = skip_to;
+        if (**p == '\0') {
+            return;
+        }
+    }
+    if (**p == TOK_LINE) {
+        ctx->stat_gotos++;
+        ctx->current_line = read_line_target(p);
+        if (ctx->current_line < 0) {
+            runtime_error(ctx, "Target line not found");
+            return;
+        }
+        ctx->statement_pos = NULL;
+    } else {
+        /* Execute rest of line inline */
+        ctx->statement_pos = *p;
+    }
+}
+
+/* Parse FOR.  A FOR on a variable that already has a frame reuses it,
+ * dropping any loops nested inside, as CBM BASIC does. */
+static void statement_for(struct interp *ctx, unsigned char **p)
+{
+    struct lvalue lv;
+    struct value startv, endv, stepv;
+    struct for_frame *f;
+    int slot;
+    int i;
+    /* The loop variable's slot comes straight from its token */
+    slot = (**p == TOK_VAR) ? (int)get_u16(*p + 1) : -1;
+    if (!get_var_reference(ctx, p, &lv)) {
+        return;
+    }
+    if (lv.is_array) {
+        runtime_error(ctx, "FOR variable must be scalar");
+        return;
+    }
+    if (lv.is_string) {
+        runtime_error(ctx, "FOR variable must be numeric");
+        return;
+    }
+    if (**p != '=') {
+        runtime_error(ctx, "Expected '=' in FOR");
+        return;
+    }
+    (*p)++;
+    startv = eval_expression(ctx, p);
+    if (**p != TOK_TO) {
+        runtime_error(ctx, "Expected TO in FOR");
+        return;
+    }
+    (*p)++;
+    endv = eval_expression(ctx, p);
+    if (**p == TOK_STEP) {
+        (*p)++;
+        stepv = eval_expression(ctx, p);
+    } else {
+        stepv = make_int(1);
+    }
+    for (i = ctx->for_top - 1; i >= 0; i--) {
+        if (ctx->for_stack[i].slot == slot) {
+            ctx->for_top = i;
+            break;
+        }
+    }
+    if (ctx->for_top >= MAX_FOR) {
+        runtime_error(ctx, "FOR stack overflow");
+        return;
+    }
+    f = &ctx->for_stack[ctx->for_top];
+    f->slot = slot;
+    f->is_int = lv.is_int;
+    if (lv.is_int) {
+        double end;
+        if (!num_to_intvar(ctx, &startv, lv.ival) || !num_to_intvar(ctx, &stepv, &f->istep)) {
+            return;
+        }
+        /* An integer counter meets a fractional limit at its floor going
+         * up and at its ceiling going down */
+        ensure_num(ctx, &endv);
+        end = f->istep < 0 ? ceil(endv.u.num) : floor(endv.u.num);
+        if (end > MAX_INTVAR) {
+            end = MAX_INTVAR;
+        } else if (end < MIN_INTVAR) {
+            end = MIN_INTVAR;
+        }
+        f->iend = (int)end;
+        f->ivar = lv.ival;
+        f->descending = f->istep < 0;
+    } else {
+        ensure_num(ctx, &startv);
+        ensure_num(ctx, &endv);
+        ensure_num(ctx, &stepv);
+        *lv.num = startv.u.num;
+        f->end_value = endv.u.num;
+        f->step = stepv.u.num;
+        f->var = lv.num;
+        f->descending = f->step < 0;
+    }
+    f->line_index = ctx->current_line;
+    f->resume_pos = *p;
+    ctx->for_top++;
+    if (ctx->for_top > ctx->stat_for_peak) {
+        ctx->stat_for_peak = ctx->for_top;
+    }
+}
+
+/* Parse NEXT [var[, var...]].  Each step is one add, one compare and
+ * either a branch back into the loop or dropping its frame. */
+static void statement_next(struct interp *ctx, unsigned char **p)
+{
+    struct for_frame *f;
+    int slot;
+    int i;
+    int more;
+    for (;;) {
+        slot = -1;
+        if (**p == TOK_VAR) {
+            slot = (int)get_u16(*p + 1);
+            *p = skip_token(*p);
+        }
+        for (i = ctx->for_top - 1; i >= 0; i--) {
+            if (slot < 0 || ctx->for_stack[i].slot == slot) {
+                break;
+            }
+        }
+        if (i < 0) {
+            runtime_error(ctx, "NEXT without FOR");
+            return;
+        }
+        ctx->for_top = i + 1;
+        f = &ctx->for_stack[i];
+        if (f->is_int) {
+            long n;
+            n = (long)*f->ivar + f->istep;
+            more = f->descending ? n >= f->iend : n <= f->iend;
+            if (n >= MIN_INTVAR && n <= MAX_INTVAR) {
+                *f->ivar = (int)n;
+            }
+        } else {
+            *f->var += f->step;
+            more = f->descending ? *f->var >= f->end_value : *f->var <= f->end_value;
+        }
+        if (more) {
+            ctx->current_line = f->line_index;
+            ctx->statement_pos = f->resume_pos;
+            return;
+        }
+        ctx->for_top--;
+        if (slot < 0 || **p != ',') {
+            return;
+        }
+        (*p)++;
+    }
+}
+
+static void statement_dim(struct interp *ctx, unsigned char **p)
+{
+    for (;;) {
+        int extent[MAX_DIMS];
+        int ndims;
+        struct var *v;
+        struct value sizev;
+        if (**p != TOK_VAR) {
+            runtime_error(ctx, "Expected array name");
+            return;
+        }
+        v = &ctx->vars[get_u16(*p + 1)];
+        *p = skip_token(*p);
+        if (**p != '(') {
+            runtime_error(ctx, "DIM requires size");
+            return;
+        }
+        (*p)++;
+        ndims = 0;
+        for (;;) {
+            if (ndims >= MAX_DIMS) {
+                runtime_error(ctx, "Too many subscripts");
+                return;
+            }
+            sizev = eval_expression(ctx, p);
+            ensure_num(ctx, &sizev);
+            extent[ndims] = (int)sizev.u.num + 1;
+            if (extent[ndims] <= 0) {
+                runtime_error(ctx, "Invalid array size");
+                return;
+            }
+            ndims++;
+            if (**p != ',') {
+                break;
+            }
+            (*p)++;
+        }
+        if (**p != ')') {
+            runtime_error(ctx, "Missing ')'");
+            return;
+        }
+        (*p)++;
+        if (!dim_shape(ctx, v, ndims, extent)) {
+            return;
+        }
+        if (**p == ',') {
+            (*p)++;
+            continue;
+        }
+        break;
+    }
+}
+
+/* Read the array name operand of a MAT statement. */
+static struct var *mat_operand(struct interp *ctx, unsigned char **p)
+{
+    struct var *v;
+    if (**p != TOK_VAR || (*p)[3] == '(') {
+        runtime_error(ctx, "Expected array name");
+        return NULL;
+    }
+    v = &ctx->vars[get_u16(*p + 1)];
+    *p += 3;
+    return v;
+}
+
+/* Parse a MAT statement, which runs over whole arrays in one C loop:
+ *
+ *   MAT A = B          copy          MAT A = (x)        fill
+ *   MAT A = B + C      add           MAT A = (x) * B    scale
+ *   MAT A = B - C      subtract      MAT A = RND        random fill
+ *
+ * Arrays that were never dimensioned get the default size, except that
+ * a destination takes the shape of its source.  String arrays can be
+ * copied and filled. */
+static void statement_mat(struct interp *ctx, unsigned char **p)
+{
+    struct var *dest;
+    struct var *src;
+    struct var *src2;
+    struct value scalar;
+    double d;
+    int op;
+    int i;
+
+    if (**p != TOK_VAR) {
+        runtime_error(ctx, "Expected array name");
+        return;
+    }
+    dest = &ctx->vars[get_u16(*p + 1)];
+    *p = skip_token(*p);
+    if (**p != '=') {
+        runtime_error(ctx, "Expected '='");
+        return;
+    }
+    (*p)++;
+    if (**p == TOK_RND) {
+        (*p)++;
+        if (dest->is_string || dest->is_int) {
+            runtime_error(ctx, "Type mismatch");
+            return;
+        }
+        if (!mat_storage(ctx, dest)) {
+            return;
+        }
+        for (i = 0; i < dest->size; i++) {
+            dest->num_array[i] = rnd_next(ctx);
+        }
+        return;
+    }
+    src = NULL;
+    src2 = NULL;
+    op = 0;
+    scalar = make_int(0);
+    if (**p == '(') {
+        (*p)++;
+        scalar = eval_expression(ctx, p);
+        if (ctx->halted) {
+            return;
+        }
+        if (**p != ')') {
+            runtime_error(ctx, "Missing ')'");
+            return;
+        }
+        (*p)++;
+        if (**p == '*') {
+            (*p)++;
+            op = '*';
+            src = mat_operand(ctx, p);
+            if (!src) {
+                return;
+            }
+        }
+    } else {
+        src = mat_operand(ctx, p);
+        if (!src) {
+            return;
+        }
+        if (**p == '+' || **p == '-') {
+            op = *(*p)++;
+            src2 = mat_operand(ctx, p);
+            if (!src2) {
+                return;
+            }
+        }
+    }
+    if (!at_statement_end(*p)) {
+        runtime_error(ctx, "Syntax error in MAT");
+        return;
+    }
+    if (src) {
+        if (!mat_storage(ctx, src) || (src2 && !mat_storage(ctx, src2))) {
+            return;
+        }
+        if (src->is_string != dest->is_string || (src2 && src2->is_string != dest->is_string) ||
+            (dest->is_string && op)) {
+            runtime_error(ctx, "Type mismatch");
+            return;
+        }
+        if (!dest->is_array) {
+            int extent[MAX_DIMS];
+            int k;
+            for (k = 0; k < src->ndims; k++) {
+                extent[k] = src->extent[k];
+            }
+            if (src->ndims == 1) {
+                extent[0] = src->size;
+            }
+            if (!dim_shape(ctx, dest, src->ndims, extent)) {
+                return;
+            }
+        }
+        if (dest->size != src->size || dest->ndims != src->ndims ||
+            (src2 && (src2->size != src->size || src2->ndims != src->ndims))) {
+            runtime_error(ctx, "Dimension mismatch");
+            return;
+        }
+    } else if (!mat_storage(ctx, dest)) {
+        return;
+    }
+    if (dest->is_string) {
+        if (!src) {
+            ensure_str(ctx, &scalar);
+        }
+        for (i = 0; !ctx->halted && i < dest->size; i++) {
+            dest->str_array[i] = src ? src->str_array[i] : scalar;
+        }
+        return;
+    }
+    d = 0.0;
+    if (!src || op == '*') {
+        if (scalar.type == VAL_INT) {
+            d = scalar.u.ival;
+        } else {
+            ensure_num(ctx, &scalar);
+            d = scalar.u.num;
+        }
+    }
+    for (i = 0; !ctx->halted && i < dest->size; i++) {
+        double x;
+        if (!src) {
+            x = d;
+        } else if (op == '*') {
+            x = d * mat_get(src, i);
+        } else if (op == '+') {
+            x = mat_get(src, i) + mat_get(src2, i);
+        } else if (op == '-') {
+            x = mat_get(src, i) - mat_get(src2, i);
+        } else {
+            x = mat_get(src, i);
+        }
+        if (!mat_put(ctx, dest, i, x)) {
+            return;
+        }
+    }
+}
+
+/* Dispatch one statement on its leading token. */
+static void execute_statement(struct interp *ctx, unsigned char **p)
+{
+    int tok;
+    tok = **p;
+    if (tok == '\0') {
+        return;
+    }
+    if (tok == TOK_VAR) {
+        /* Default to LET style assignment */
+        statement_let(ctx, p);
+        return;
+    }
+    (*p)++;
+    switch (tok) {
+    case TOK_REM:
+        statement_rem(p);
+        return;
+    case TOK_PRINT:
+        statement_print(ctx, p);
+        return;
+    case TOK_INPUT:
+        statement_input(ctx, p);
+        return;
+    case TOK_LET:
+        if (**p == TOK_TI_S) {
+            execute_statement(ctx, p);
+            return;
+        }
+        statement_let(ctx, p);
+        return;
+    case TOK_TI_S:
+        statement_set_clock(ctx, p);
+        return;
+    case TOK_GOTO:
+        statement_goto(ctx, p);
+        return;
+    case TOK_GOSUB:
+        statement_gosub(ctx, p);
+        return;
+    case TOK_RETURN:
+        statement_return(ctx, p);
+        return;
+    case TOK_IF:
+        statement_if(ctx, p);
+        return;
+    case TOK_FOR:
+        statement_for(ctx, p);
+        return;
+    case TOK_NEXT:
+        statement_next(ctx, p);
+        return;
+    case TOK_DIM:
+        statement_dim(ctx, p);
+        return;
+    case TOK_SLEEP:
+        statement_sleep(ctx, p);
+        return;
+    case TOK_DATA:
+        /* Already pooled at load; DATA is a no-op when reached */
+        (*p)--;
+        *p = skip_token(*p);
+        return;
+    case TOK_READ:
+        statement_read(ctx, p);
+        return;
+    case TOK_RESTORE:
+        statement_restore(ctx, p);
+        return;
+    case TOK_ON:
+        statement_on(ctx, p);
+        return;
+    case TOK_MAT:
+        statement_mat(ctx, p);
+        return;
+    case TOK_ELSE:
+        /* Reached the end of a THEN clause */
+        skip_to_eol(p);
+        return;
+    case TOK_END:
+    case TOK_STOP:
+        ctx->halted = 1;
+        skip_to_eol(p);
+        return;
+    }
+    (*p)--;
+    runtime_error(ctx, "Unknown statement");
+}
+
+/* Binary search the sorted line table for the first line numbered at
+ * least `number'; returns line_count when every line is lower. */
+static int line_lower_bound(struct interp *ctx, int number)
+{
+    int lo, hi, mid;
+    lo = 0;
+    hi = ctx->line_count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ctx->program_lines[mid].number < number) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int find_line_index(struct interp *ctx, int number)
+{
+    int i;
+    i = line_lower_bound(ctx, number);
+    if (i < ctx->line_count && ctx->program_lines[i].number == number) {
+        return i;
+    }
+    return -1;
+}
+
+/* Patch every TOK_LINE with the index of the line it names.  Runs once
+ * after loading, when the line table is final. */
+static void resolve_line_refs(struct interp *ctx)
+{
+    int i;
+    unsigned char *p;
+    for (i = 0; i < ctx->line_count; i++) {
+        p = ctx->program_lines[i].code;
+        while (*p) {
+            if (*p == TOK_LINE) {
+                int index;
+                index = find_line_index(ctx, (int)get_u16(p + 1));
+                put_u16(p + 3, index < 0 ? NO_LINE : (unsigned)index);
+            }
+            p = skip_token(p);
+        }
+    }
+}
+
+/* Crunch a source line and insert it in line-number order, replacing any
+ * line with the same number.  Programs are normally written in ascending
+ * order, so the common case is a plain append with no search at all. */
+static void add_or_replace_line(struct interp *ctx, int number, const char *text)
+{
+    int i;
+    unsigned char *code;
+    code = crunch_line(ctx, text);
+    if (!code) {
+        return;
+    }
+    if (ctx->line_count > 0 && number <= ctx->program_lines[ctx->line_count - 1].number) {
+        i = line_lower_bound(ctx, number);
+        if (ctx->program_lines[i].number == number) {
+            /* The old code is simply abandoned in the arena */
+            ctx->program_lines[i].code = code;
+            return;
+        }
+    } else {
+        i = ctx->line_count;
+    }
+    if (ctx->line_count >= ctx->line_capacity) {
+        runtime_error(ctx, "Program too large");
+        return;
+    }
+    if (i < ctx->line_count) {
+        memmove(&ctx->program_lines[i + 1], &ctx->program_lines[i], (ctx->line_count - i) * sizeof(struct line));
+    }
+    ctx->program_lines[i].number = number;
+    ctx->program_lines[i].code = code;
+    ctx->line_count++;
+}
+
+/* Add the items of one DATA statement's raw text to the pool.  Items that
+ * read as numbers are converted here; every item also keeps its text,
+ * which stays in the crunched line, for READ into a string. */
+static int add_data_items(struct interp *ctx, char *s, int len)
+{
+    char *end;
+    char *start;
+    char *stop;
+    char numbuf[64];
+    char *q;
+    struct data_item *item;
+    struct data_item *grown;
+    double num;
+    end = s + len;
+    for (;;) {
+        while (s < end && *s == ' ') {
+            s++;
+        }
+        if (s < end && *s == '\"') {
+            start = ++s;
+            while (s < end && *s != '\"') {
+                s++;
+            }
+            stop = s;
+            while (s < end && *s != ',') {
+                s++;
+            }
+        } else {
+            start = s;
+            while (s < end && *s != ',') {
+                s++;
+            }
+            stop = s;
+            while (stop > start && stop[-1] == ' ') {
+                stop--;
+            }
+        }
+        if (ctx->data_count >= ctx->data_cap) {
+            ctx->data_cap = ctx->data_cap ? ctx->data_cap * 2 : 32;
+            grown = (struct data_item *)realloc(ctx->data_pool, ctx->data_cap * sizeof(struct data_item));
+            if (!grown) {
+                runtime_error(ctx, "Out of memory");
+                return 0;
+            }
+            ctx->data_pool = grown;
+        }
+        item = &ctx->data_pool[ctx->data_count++];
+        item->text = make_str_ref(start, stop - start);
+        item->is_num = 0;
+        item->num = make_int(0);
+        if (stop - start == 0) {
+            item->is_num = 1;
+        } else if (stop - start < (int)sizeof(numbuf)) {
+            memcpy(numbuf, start, stop - start);
+            numbuf[stop - start] = '\0';
+            q = numbuf;
+            num = 0.0;
+            if (parse_number_literal(&q, &num) && *q == '\0') {
+                item->is_num = 1;
+                if (num == floor(num) && num >= MIN_INTVAR && num <= MAX_INTVAR) {
+                    item->num = make_int((int)num);
+                } else {
+                    item->num = make_num(num);
+                }
+            }
+        }
+        if (s >= end) {
+            return 1;
+        }
+        s++;    /* past the comma */
+    }
+}
+
+/* Collect every DATA item, in line order, into data_pool and record in
+ * each line the index of its first item for RESTORE. */
+static void build_data_pool(struct interp *ctx)
+{
+    int i;
+    unsigned char *p;
+    ctx->data_count = 0;
+    for (i = 0; i < ctx->line_count; i++) {
+        ctx->program_lines[i].data_index = ctx->data_count;
+        p = ctx->program_lines[i].code;
+        while (*p) {
+            if (*p == TOK_DATA && !add_data_items(ctx, (char *)p + 3, (int)get_u16(p + 1))) {
+                return;
+            }
+            p = skip_token(p);
+        }
+    }
+    ctx->data_next = 0;
+}
+
+/* Read the whole program file into one buffer, mapping it where mmap()
+ * is available.  The buffer is writable so lines can be terminated in
+ * place; release it with free_source().  Returns NULL, reporting why,
+ * on failure. */
+static char *read_source(struct interp *ctx, const char *path, long *size_out)
+{
+    char *text;
+    long size;
+#ifdef HAVE_MMAP
+    int fd;
+    struct stat st;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(ctx->err, "Cannot open %s\n", path);
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        text = (char *)mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (text != (char *)MAP_FAILED) {
+            close(fd);
+            ctx->source_mapped = 1;
+            *size_out = (long)st.st_size;
+            return text;
+        }
+    }
+    close(fd);
+#endif
+    {
+        FILE *f;
+        f = fopen(path, "r");
+        if (!f) {
+            fprintf(ctx->err, "Cannot open %s\n", path);
+            return NULL;
+        }
+        fseek(f, 0L, SEEK_END);
+        size = ftell(f);
+        fseek(f, 0L, SEEK_SET);
+        if (size < 0) {
+            size = 0;
+        }
+        text = (char *)malloc((size_t)size + 1);
+        if (!text) {
+            fclose(f);
+            fprintf(ctx->err, "Out of memory loading %s\n", path);
+            return NULL;
+        }
+        size = (long)fread(text, 1, (size_t)size, f);
+        fclose(f);
+        ctx->source_mapped = 0;
+        *size_out = size;
+        return text;
+    }
+}
+
+/* Release the buffer from read_source(). */
+static void free_source(struct interp *ctx, char *text, long size)
+{
+#ifdef HAVE_MMAP
+    if (ctx->source_mapped) {
+        munmap(text, (size_t)size);
+        return;
+    }
+#endif
+    (void)size;
+    free(text);
+}
+
+/* Load and crunch the program source at `path'.  Returns 0, having
+ * reported the problem, if it cannot be loaded. */
+static int load_program(struct interp *ctx, const char *path)
+{
+    char *text;
+    char *end;
+    char *next;
+    char *line;
+    long size;
+    long count;
+    text = read_source(ctx, path, &size);
+    if (!text) {
+        return 0;
+    }
+    end = text + size;
+    /* One line record per source line is always enough */
+    count = 1;
+    for (next = text; next < end; next++) {
+        if (*next == '\n') {
+            count++;
+        }
+    }
+    if (count > MAX_LINES) {
+        count = MAX_LINES;
+    }
+    ctx->program_lines = (struct line *)malloc((size_t)count * sizeof(struct line));
+    if (!ctx->program_lines) {
+        fprintf(ctx->err, "Out of memory loading %s\n", path);
+        free_source(ctx, text, size);
+        return 0;
+    }
+    ctx->line_capacity = (int)count;
+    /* Crunched code is rarely larger than its source, so the first arena
+     * block normally holds the whole program */
+    if (size > ARENA_BLOCK && size <= 0x7fffL) {
+        ctx->arena_block = (int)size;
+    }
+    for (line = text; line < end; line = next) {
+        char *p;
+        char *eol;
+        long number;
+        int copied;
+        eol = line;
+        while (eol < end && *eol != '\n') {
+            eol++;
+        }
+        next = eol + 1;
+        if (eol > line && eol[-1] == '\r') {
+            eol--;
+        }
+        copied = 0;
+        if (eol == end && ctx->source_mapped) {
+            /* A mapped file has no room after an unterminated last line */
+            char *copy;
+            copy = (char *)malloc(eol - line + 1);
+            if (!copy) {
+                fprintf(ctx->err, "Out of memory loading %s\n", path);
+                ctx->halted = 1;
+                break;
+            }
+            memcpy(copy, line, eol - line);
+            copy[eol - line] = '\0';
+            line = copy;
+            copied = 1;
+        } else {
+            *eol = '\0';
+        }
+        p = line;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        /* Skip UTF-8 BOM if present */
+        if ((unsigned char)p[0] == 0xef && (unsigned char)p[1] == 0xbb && (unsigned char)p[2] == 0xbf) {
+            p += 3;
+        }
+        /* Ignore empty or whitespace-only lines */
+        if (*p != '\0') {
+            if (!isdigit((unsigned char)*p)) {
+                fprintf(ctx->err, "Line missing number: %s\n", line);
+                ctx->halted = 1;
+            } else {
+                number = 0;
+                while (isdigit((unsigned char)*p) && number <= MAX_LINE_NUMBER) {
+                    number = number * 10 + (*p - '0');
+                    p++;
+                }
+                while (*p && !isspace((unsigned char)*p)) {
+                    p++;
+                }
+                while (*p == ' ' || *p == '\t') {
+                    p++;
+                }
+                if (number > MAX_LINE_NUMBER) {
+                    fprintf(ctx->err, "Line number out of range: %s\n", line);
+                    ctx->halted = 1;
+                } else {
+                    add_or_replace_line(ctx, (int)number, p);
+                }
+            }
+        }
+        if (copied) {
+            free(line);
+        }
+        if (ctx->halted) {
+            /* Bad line, table full or out of memory; already reported */
+            break;
+        }
+    }
+    free_source(ctx, text, size);
+    if (ctx->halted) {
+        return 0;
+    }
+    resolve_line_refs(ctx);
+    build_data_pool(ctx);
+    return !ctx->halted;
+}
+
+/* Count the statement about to run at `p' on line `line'. */
+static void profile_statement(struct interp *ctx, int line, unsigned char *p)
+{
+    ctx->prof_total++;
+    if (line != ctx->prof_prev_line || p <= ctx->prof_prev_pos) {
+        ctx->prof_hits[line]++;
+    }
+    ctx->prof_prev_line = line;
+    ctx->prof_prev_pos = p;
+    ctx->prof_line_stmts[line]++;
+    ctx->prof_stmt[*p == TOK_VAR ? TOK_LET : *p]++;
+    if (ctx->profile_time) {
+        clock_t now;
+        now = clock();
+        if (ctx->prof_last_line >= 0) {
+            ctx->prof_time[ctx->prof_last_line] += (double)(now - ctx->prof_last_clock) / CLOCKS_PER_SEC;
+        }
+        ctx->prof_last_clock = now;
+        ctx->prof_last_line = line;
+    }
+}
+
+/* Begin a run at the first line, deciding the output and input modes
+ * from the streams if nobody has. */
+static void run_start(struct interp *ctx)
+{
+    if (ctx->out_interactive < 0) {
+        ctx->out_interactive = isatty(fileno(ctx->out));
+    }
+    if (ctx->input_batch < 0) {
+        ctx->input_batch = !isatty(ctx->in_fd);
+    }
+    ctx->halted = 0;
+    ctx->error = NULL;
+    ctx->sleeping = 0;
+    ctx->current_line = 0;
+    ctx->statement_pos = NULL;
+    ctx->print_col = 0;
+    ctx->running = 1;
+    ctx->stat_statements = 0;
+    ctx->stat_gotos = 0;
+    ctx->stat_gosubs = 0;
+    ctx->stat_resizes = 0;
+    ctx->stat_str_bytes = 0;
+    ctx->stat_str_peak = 0;
+    ctx->stat_for_peak = 0;
+    ctx->stat_gosub_peak = 0;
+    ctx->stat_start = jiffies();
+}
+
+/* Execute up to `budget' statements of the current run, or until it ends
+ * when `budget' is negative, stopping early at a yielding SLEEP.  Returns
+ * 1 if the run has more to do. */
+static int run_statements(struct interp *ctx, long budget)
+{
+    while (budget != 0 && !ctx->halted && !ctx->sleeping &&
+           ctx->current_line >= 0 && ctx->current_line < ctx->line_count) {
+        if (ctx->statement_pos == NULL) {
+            ctx->statement_pos = ctx->program_lines[ctx->current_line].code;
+        }
+        if (*ctx->statement_pos == '\0') {
+            ctx->current_line++;
+            ctx->statement_pos = NULL;
+            continue;
+        }
+        ctx->str_root_top = 0;
+        if (ctx->profiling) {
+            profile_statement(ctx, ctx->current_line, ctx->statement_pos);
+        }
+        execute_statement(ctx, &ctx->statement_pos);
+        ctx->stat_statements++;
+        if (budget > 0) {
+            budget--;
+        }
+        if (ctx->halted) {
+            break;
+        }
+        if (ctx->statement_pos == NULL) {
+            continue;
+        }
+        if (*ctx->statement_pos == ':') {
+            ctx->statement_pos++;
+            continue;
+        }
+        if (*ctx->statement_pos == '\0') {
+            ctx->current_line++;
+            ctx->statement_pos = NULL;
+        }
+    }
+    /* A SLEEP that was the last statement still has to be waited out */
+    if (ctx->halted ||
+        (!ctx->sleeping && (ctx->current_line < 0 || ctx->current_line >= ctx->line_count))) {
+        ctx->running = 0;
+        ctx->stat_end = jiffies();
+    }
+    return ctx->running;
 }
 
-/* Break a BASIC variable name into two-letter uppercase key and detect strings. */
-static void uppercase_name(const char *src, char *n1, char *n2, int *is_string)
+/* Run the program to the end.  A yielding SLEEP is waited out here. */
+static void run_program(struct interp *ctx)
 {
-    int len;
-    len = (int)strlen(src);
-    *is_string = 0;
-    if (len > 0 && src[len - 1] == '$') {
-        *is_string = 1;
-        len--;
-    }
-    if (len < 1) {
-        *n1 = ' ';
-        *n2 = ' ';
-        return;
-    }
-    *n1 = toupper((unsigned char)src[0]);
-    if (len > 1) {
-        *n2 = toupper((unsigned char)src[1]);
-    } else {
-        *n2 = ' ';
+    run_start(ctx);
+    while (run_statements(ctx, -1L)) {
+        do_sleep_ticks((double)(long)(ctx->wake_time - jiffies()));
+        ctx->sleeping = 0;
     }
 }
 
-static struct var *find_or_create_var(char name1, char name2, int is_string, int want_array, int array_size)
+/* Put every variable back to its initial value and drop arrays, loops,
+ * subroutine returns, the READ position, strings and buffered input, so
+ * the loaded program can run again from scratch. */
+static void reset_run_state(struct interp *ctx)
 {
-    int i, idx;
     struct var *v;
-    for (i = 0; i < var_count; i++) {
-        if (vars[i].name1 == name1 && vars[i].name2 == name2 && vars[i].is_string == is_string) {
-            v = &vars[i];
-            if (want_array && !v->is_array) {
-                v->is_array = 1;
-                v->size = array_size;
-                v->array = (struct value *)calloc(array_size, sizeof(struct value));
-                if (!v->array) {
-                    runtime_error("Out of memory");
-                    return v;
-                }
-            } else if (want_array && array_size > v->size) {
-                /* Resize array when needed */
-                struct value *new_arr;
-                new_arr = (struct value *)realloc(v->array, array_size * sizeof(struct value));
-                if (new_arr) {
-                    v->array = new_arr;
-                    v->size = array_size;
-                } else {
-                    runtime_error("Out of memory");
-                }
-            }
-            return v;
-        }
-    }
-    if (var_count >= MAX_VARS) {
-        runtime_error("Variable table full");
-        return NULL;
-    }
-    idx = var_count++;
-    v = &vars[idx];
-    v->name1 = name1;
-    v->name2 = name2;
-    v->is_string = is_string;
-    v->is_array = want_array;
-    v->size = want_array ? array_size : 0;
-    v->array = NULL;
-    v->scalar = make_num(0.0);
-    if (is_string) {
-        v->scalar = make_str("");
-    }
-    if (want_array) {
-        v->array = (struct value *)calloc(array_size, sizeof(struct value));
-        if (!v->array) {
-            runtime_error("Out of memory");
+    int i;
+    for (i = 0; i < ctx->var_count; i++) {
+        v = &ctx->vars[i];
+        free(v->num_array);
+        free(v->int_array);
+        free(v->str_array);
+        v->num_array = NULL;
+        v->int_array = NULL;
+        v->str_array = NULL;
+        v->is_array = 0;
+        v->size = 0;
+        v->ndims = 0;
+        if (v->is_string) {
+            v->scalar = make_str_ref((char *)"", 0);
+        } else if (v->is_int) {
+            v->scalar = make_int(0);
+        } else {
+            v->scalar = make_num(0.0);
         }
     }
-    return v;
+    ctx->for_top = 0;
+    ctx->gosub_top = 0;
+    ctx->data_next = 0;
+    ctx->str_top = ctx->str_space;
+    ctx->str_root_top = 0;
+    ctx->eval_top = 0;
+    ctx->in_pos = 0;
+    ctx->in_len = 0;
+    ctx->rnd_state = RND_SEED;
 }
 
-/* Read an identifier (letters/digits/$) into buf, advancing the pointer. */
-static int read_identifier(char **p, char *buf, int buf_size)
+/* Build the tables shared by every interpreter. */
+static void init_tables(void)
 {
-    int i;
-    i = 0;
-    while ((isalpha((unsigned char)(**p)) || isdigit((unsigned char)(**p)) || **p == '$') && i < buf_size - 1) {
-        buf[i++] = **p;
-        (*p)++;
+    int c;
+    struct tms t;
+    if (!keyword_index_built) {
+        build_keyword_index();
+    }
+    if (clock_rate == 0) {
+#ifdef _SC_CLK_TCK
+        clock_rate = sysconf(_SC_CLK_TCK);
+#endif
+        if (clock_rate <= 0) {
+            clock_rate = TICKS_PER_SEC_FALLBACK;
+        }
+        clock_origin = times(&t);
+    }
+    if (!chr_table_ready) {
+        for (c = 0; c < 256; c++) {
+            chr_table[c] = (char)c;
+        }
+        chr_table_ready = 1;
     }
-    buf[i] = '\0';
-    return i;
 }
 
-/* Resolve a variable (and optional array index) creating it if needed. */
-static struct value *get_var_reference(char **p, int *is_array_out, int *is_string_out)
+/* Find the variable a program would write as `name' ("N", "X1", "NAME$",
+ * "I%"; as in a program only two characters count), creating it if the
+ * program never mentions it.  NULL if the name is not valid. */
+static struct var *named_var(struct interp *ctx, const char *name)
 {
-    char namebuf[16];
-    char n1, n2;
-    int is_string;
-    struct var *v;
-    struct value *valp;
-    int is_array;
-    int array_size;
-    int array_index;
-    struct value idx_val;
-
-    skip_spaces(p);
-    if (!isalpha((unsigned char)**p)) {
-        runtime_error("Expected variable");
+    char name1, name2;
+    int type;
+    int i;
+    if (!isalpha((unsigned char)name[0])) {
         return NULL;
     }
-    read_identifier(p, namebuf, sizeof(namebuf));
-    uppercase_name(namebuf, &n1, &n2, &is_string);
-    if (is_string_out) {
-        *is_string_out = is_string;
-    }
-    skip_spaces(p);
-    is_array = 0;
-    array_size = 0;
-    array_index = -1;
-    if (**p == '(') {
-        is_array = 1;
-        (*p)++;
-        idx_val = eval_or_expr(p);
-        ensure_num(&idx_val);
-        skip_spaces(p);
-        if (**p != ')') {
-            runtime_error("Missing ')'");
-            return NULL;
-        }
-        (*p)++;
-        array_index = (int)(idx_val.num + 0.00001);
-        if (array_index < 0) {
-            runtime_error("Negative array index");
-            return NULL;
-        }
-        array_size = array_index + 1;
-        if (array_size < DEFAULT_ARRAY_SIZE) {
-            array_size = DEFAULT_ARRAY_SIZE;
+    name1 = (char)toupper((unsigned char)name[0]);
+    name2 = ' ';
+    for (i = 1; isalnum((unsigned char)name[i]); i++) {
+        if (i == 1) {
+            name2 = (char)toupper((unsigned char)name[1]);
         }
     }
-    if (is_array_out) {
-        *is_array_out = is_array;
+    type = VAL_NUM;
+    if (name[i] == '$') {
+        type = VAL_STR;
+        i++;
+    } else if (name[i] == '%') {
+        type = VAL_INT;
+        i++;
     }
-    v = find_or_create_var(n1, n2, is_string, is_array, is_array ? array_size : 0);
-    if (!v) {
+    if (name[i] != '\0') {
         return NULL;
     }
-    if (!is_array) {
-        valp = &v->scalar;
-    } else {
-        if (array_index >= v->size) {
-            struct value *new_arr;
-            new_arr = (struct value *)realloc(v->array, (array_index + 1) * sizeof(struct value));
-            if (!new_arr) {
-                runtime_error("Out of memory");
-                return NULL;
-            }
-            memset(new_arr + v->size, 0, (array_index + 1 - v->size) * sizeof(struct value));
-            v->array = new_arr;
-            v->size = array_index + 1;
-        }
-        valp = &v->array[array_index];
-    }
-    if (is_string && valp->type != VAL_STR) {
-        *valp = make_str("");
-    } else if (!is_string && valp->type != VAL_NUM) {
-        *valp = make_num(0.0);
-    }
-    return valp;
+    return find_or_create_var(ctx, name1, name2, type);
 }
 
-/* Check if this is a known function name */
-static int is_function_name(char *p)
+/* Embedding API, see basic.h */
+
+struct interp *basic_new(void)
 {
-    if (starts_with_kw(p, "SIN") || starts_with_kw(p, "COS") || starts_with_kw(p, "TAN") ||
-        starts_with_kw(p, "ATN") || starts_with_kw(p, "ABS") || starts_with_kw(p, "INT") ||
-        starts_with_kw(p, "SQR") || starts_with_kw(p, "SGN") || starts_with_kw(p, "EXP") ||
-        starts_with_kw(p, "LOG") || starts_with_kw(p, "RND") || starts_with_kw(p, "LEN") ||
-        starts_with_kw(p, "VAL") || starts_with_kw(p, "ASC") || starts_with_kw(p, "TAB") ||
-        starts_with_kw(p, "NOT") || starts_with_kw(p, "FRE") || starts_with_kw(p, "POS") ||
-        starts_with_kw(p, "INSTR")) {
-        return 1;
-    }
-    /* String functions with $ */
-    if (starts_with_kw_dollar(p, "STR$") || starts_with_kw_dollar(p, "CHR$") ||
-        starts_with_kw_dollar(p, "LEFT$") || starts_with_kw_dollar(p, "RIGHT$") ||
-        starts_with_kw_dollar(p, "MID$")) {
-        return 1;
+    struct interp *ctx;
+    init_tables();
+    ctx = (struct interp *)calloc(1, sizeof(struct interp));
+    if (!ctx) {
+        return NULL;
     }
-    return 0;
+    ctx->arena_block = ARENA_BLOCK;
+    ctx->str_top = ctx->str_space;
+    ctx->rnd_state = RND_SEED;
+    ctx->out = stdout;
+    ctx->err = stderr;
+    ctx->in_fd = 0;
+    ctx->out_interactive = -1;
+    ctx->input_batch = -1;
+    ctx->prof_last_line = -1;
+    return ctx;
 }
 
-/* Parse a factor: number, string, variable, function call, or parenthesized expr. */
-static struct value eval_factor(char **p)
+void basic_free(struct interp *ctx)
 {
-    struct value v;
-    char buf[MAX_LINE_LEN];
-    double num;
-    skip_spaces(p);
-    if (**p == '(') {
-        (*p)++;
-        v = eval_or_expr(p);
-        skip_spaces(p);
-        if (**p == ')') {
-            (*p)++;
-        } else {
-            runtime_error("Missing ')'");
-        }
-        return v;
-    }
-    if (**p == '\"') {
-        int i;
-        (*p)++;
-        i = 0;
-        while (**p && **p != '\"' && i < MAX_STR_LEN - 1) {
-            buf[i++] = **p;
-            (*p)++;
-        }
-        buf[i] = '\0';
-        if (**p == '\"') {
-            (*p)++;
-        } else {
-            runtime_error("Unterminated string");
-        }
-        return make_str(buf);
-    }
-    if (isalpha((unsigned char)**p)) {
-        /* Function call? */
-        if (is_function_name(*p)) {
-            char namebuf[16];
-            char *q;
-            q = *p;
-            read_identifier(&q, namebuf, sizeof(namebuf));
-            return eval_function(namebuf, p);
-        } else {
-            struct value *vp;
-            vp = get_var_reference(p, NULL, NULL);
-            if (!vp) {
-                return make_num(0.0);
-            }
-            return *vp;
-        }
+    struct arena_block *block;
+    if (!ctx) {
+        return;
     }
-    if (**p == '+' || **p == '-') {
-        char sign;
-        struct value inner;
-        sign = **p;
-        (*p)++;
-        inner = eval_factor(p);
-        ensure_num(&inner);
-        if (sign == '-') {
-            inner.num = -inner.num;
-        }
-        return inner;
+    reset_run_state(ctx);
+    while ((block = ctx->arena_blocks) != NULL) {
+        ctx->arena_blocks = block->next;
+        free(block);
+    }
+    free(ctx->image_buf);
+    if (!ctx->shared) {
+        free(ctx->program_lines);
+        free(ctx->data_pool);
+    }
+    free(ctx->gosub_stack);
+    free(ctx->crunch_buf.data);
+    free(ctx->compile_buf.data);
+    free(ctx->prof_hits);
+    free(ctx->prof_line_stmts);
+    free(ctx->prof_time);
+    free(ctx);
+}
+
+struct interp *basic_clone(struct interp *from)
+{
+    struct interp *ctx;
+    int i;
+    if (!from->program_lines) {
+        return NULL;
     }
-    if (parse_number_literal(p, &num)) {
-        return make_num(num);
+    ctx = basic_new();
+    if (!ctx) {
+        return NULL;
     }
-    runtime_error("Syntax error in expression");
-    return make_num(0.0);
+    ctx->program_lines = from->program_lines;
+    ctx->line_count = from->line_count;
+    ctx->line_capacity = from->line_capacity;
+    ctx->data_pool = from->data_pool;
+    ctx->data_count = from->data_count;
+    ctx->data_cap = from->data_cap;
+    ctx->shared = 1;
+    /* The code refers to variables by slot, so the clone needs the same
+     * slots, empty */
+    memcpy(ctx->var_slot_table, from->var_slot_table, sizeof(ctx->var_slot_table));
+    for (i = 0; i < from->var_count; i++) {
+        ctx->vars[i].name1 = from->vars[i].name1;
+        ctx->vars[i].name2 = from->vars[i].name2;
+        ctx->vars[i].is_string = from->vars[i].is_string;
+        ctx->vars[i].is_int = from->vars[i].is_int;
+    }
+    ctx->var_count = from->var_count;
+    ctx->stat_vars = from->stat_vars;
+    reset_run_state(ctx);
+    ctx->array_autogrow = from->array_autogrow;
+    ctx->out_interactive = from->out_interactive;
+    ctx->input_batch = from->input_batch;
+    ctx->profiling = from->profiling;
+    ctx->profile_time = from->profile_time;
+    ctx->stats = from->stats;
+    ctx->sleep_yield = from->sleep_yield;
+    return ctx;
 }
 
-/* Parse exponentiation (right-associative ^). */
-static struct value eval_power(char **p)
+void basic_set_io(struct interp *ctx, int in_fd, FILE *out, FILE *err)
 {
-    struct value left, right;
-    skip_spaces(p);
-    left = eval_factor(p);
-    skip_spaces(p);
-    if (**p == '^') {
-        (*p)++;
-        right = eval_power(p);
-        ensure_num(&left);
-        ensure_num(&right);
-        left.num = pow(left.num, right.num);
-    }
-    return left;
+    out_flush(ctx);
+    ctx->in_fd = in_fd;
+    ctx->in_pos = 0;
+    ctx->in_len = 0;
+    ctx->out = out;
+    ctx->err = err;
 }
 
-/* Parse *,/ terms. */
-static struct value eval_term(char **p)
+int basic_load(struct interp *ctx, const char *path)
 {
-    struct value left, right;
-    skip_spaces(p);
-    left = eval_power(p);
-    for (;;) {
-        skip_spaces(p);
-        if (**p == '*' || **p == '/') {
-            char op;
-            op = **p;
-            (*p)++;
-            right = eval_power(p);
-            ensure_num(&left);
-            ensure_num(&right);
-            if (op == '*') {
-                left.num *= right.num;
-            } else {
-                left.num /= right.num;
-            }
-        } else {
-            break;
-        }
+    if (ctx->program_lines) {
+        fprintf(ctx->err, "%s: a program is already loaded\n", path);
+        return 0;
     }
-    return left;
+    return load_program(ctx, path);
 }
 
-/* Parse + and - expressions (with string concatenation on +). */
-static struct value eval_expr(char **p)
+void basic_reset(struct interp *ctx)
 {
-    struct value left, right;
-    skip_spaces(p);
-    left = eval_term(p);
-    for (;;) {
-        skip_spaces(p);
-        if (**p == '+' || **p == '-') {
-            char op;
-            op = **p;
-            (*p)++;
-            right = eval_term(p);
-            if (op == '+') {
-                if (left.type == VAL_STR || right.type == VAL_STR) {
-                    ensure_str(&left);
-                    ensure_str(&right);
-                    strncat(left.str, right.str, MAX_STR_LEN - strlen(left.str) - 1);
-                } else {
-                    left.num += right.num;
-                }
-            } else {
-                ensure_num(&left);
-                ensure_num(&right);
-                left.num -= right.num;
-            }
-        } else {
-            break;
-        }
-    }
-    return left;
-}
-
-/* Parse comparison expressions (relational operators) */
-static struct value eval_comparison(char **p)
-{
-    struct value left, right;
-    char op1, op2;
-    skip_spaces(p);
-    left = eval_expr(p);
-    skip_spaces(p);
-    op1 = **p;
-    op2 = *(*p + 1);
-    
-    /* Check for two-character operators first */
-    if (op1 == '<' && op2 == '>') {
-        *p += 2;
-        right = eval_expr(p);
-        if (left.type == VAL_STR || right.type == VAL_STR) {
-            ensure_str(&left);
-            ensure_str(&right);
-            return make_num(strcmp(left.str, right.str) != 0 ? -1.0 : 0.0);
-        }
-        return make_num(left.num != right.num ? -1.0 : 0.0);
-    }
-    if (op1 == '<' && op2 == '=') {
-        *p += 2;
-        right = eval_expr(p);
-        ensure_num(&left);
-        ensure_num(&right);
-        return make_num(left.num <= right.num ? -1.0 : 0.0);
-    }
-    if (op1 == '>' && op2 == '=') {
-        *p += 2;
-        right = eval_expr(p);
-        ensure_num(&left);
-        ensure_num(&right);
-        return make_num(left.num >= right.num ? -1.0 : 0.0);
-    }
-    /* Single character operators */
-    if (op1 == '<') {
-        (*p)++;
-        right = eval_expr(p);
-        if (left.type == VAL_STR || right.type == VAL_STR) {
-            ensure_str(&left);
-            ensure_str(&right);
-            return make_num(strcmp(left.str, right.str) < 0 ? -1.0 : 0.0);
+    reset_run_state(ctx);
+    ctx->running = 0;
+    ctx->sleeping = 0;
+}
+
+int basic_run(struct interp *ctx)
+{
+    run_program(ctx);
+    out_flush(ctx);
+    return ctx->error ? BASIC_ERROR : BASIC_DONE;
+}
+
+int basic_step(struct interp *ctx, long count)
+{
+    if (ctx->sleeping) {
+        if ((long)(jiffies() - ctx->wake_time) < 0) {
+            return BASIC_SLEEPING;
         }
-        return make_num(left.num < right.num ? -1.0 : 0.0);
+        ctx->sleeping = 0;
     }
-    if (op1 == '>') {
-        (*p)++;
-        right = eval_expr(p);
-        if (left.type == VAL_STR || right.type == VAL_STR) {
-            ensure_str(&left);
-            ensure_str(&right);
-            return make_num(strcmp(left.str, right.str) > 0 ? -1.0 : 0.0);
-        }
-        return make_num(left.num > right.num ? -1.0 : 0.0);
+    if (!ctx->running) {
+        run_start(ctx);
     }
-    if (op1 == '=') {
-        (*p)++;
-        right = eval_expr(p);
-        if (left.type == VAL_STR || right.type == VAL_STR) {
-            ensure_str(&left);
-            ensure_str(&right);
-            return make_num(strcmp(left.str, right.str) == 0 ? -1.0 : 0.0);
-        }
-        return make_num(left.num == right.num ? -1.0 : 0.0);
+    if (run_statements(ctx, count)) {
+        return ctx->sleeping ? BASIC_SLEEPING : BASIC_READY;
     }
-    /* No comparison operator, just return the value */
-    return left;
+    out_flush(ctx);
+    return ctx->error ? BASIC_ERROR : BASIC_DONE;
 }
 
-/* Parse AND expressions (logical/bitwise) */
-static struct value eval_and_expr(char **p)
+void basic_set_sleep_yield(struct interp *ctx, int yield)
 {
-    struct value left, right;
-    skip_spaces(p);
-    left = eval_comparison(p);
-    for (;;) {
-        skip_spaces(p);
-        if (starts_with_kw(*p, "AND")) {
-            *p += 3;
-            right = eval_comparison(p);
-            ensure_num(&left);
-            ensure_num(&right);
-            left.num = (double)((int)left.num & (int)right.num);
-        } else {
-            break;
-        }
-    }
-    return left;
+    ctx->sleep_yield = yield;
 }
 
-/* Parse OR expressions (logical/bitwise, lowest precedence) */
-static struct value eval_or_expr(char **p)
+unsigned long basic_wake_time(struct interp *ctx)
 {
-    struct value left, right;
-    skip_spaces(p);
-    left = eval_and_expr(p);
-    for (;;) {
-        skip_spaces(p);
-        if (starts_with_kw(*p, "OR")) {
-            *p += 2;
-            right = eval_and_expr(p);
-            ensure_num(&left);
-            ensure_num(&right);
-            left.num = (double)((int)left.num | (int)right.num);
-        } else {
-            break;
-        }
-    }
-    return left;
+    return ctx->wake_time;
 }
 
-/* Evaluate IF conditions - now simplified since comparisons are in eval_comparison */
-static int eval_condition(char **p)
+unsigned long basic_clock(void)
 {
-    struct value result;
-    skip_spaces(p);
-    result = eval_or_expr(p);
-    if (result.type == VAL_STR) {
-        return strlen(result.str) > 0;
-    }
-    return result.num != 0.0;
+    return jiffies();
 }
 
-/* Skip rest of line (REM or ' comment). */
-static void statement_rem(char **p)
+double basic_stat(struct interp *ctx, int which)
 {
-    *p += strlen(*p);
+    return stat_value(ctx, which);
 }
 
-static void statement_print(char **p)
+const char *basic_error(struct interp *ctx)
 {
-    int newline;
-    struct value v;
-    newline = 1;
-    for (;;) {
-        skip_spaces(p);
-        if (**p == '\0' || **p == ':') {
-            break;
-        }
-        v = eval_or_expr(p);
-        print_value(&v);
-        skip_spaces(p);
-        if (**p == ';') {
-            newline = 0;
-            (*p)++;
-        } else if (**p == ',') {
-            newline = 0;
-            {
-                int zone;
-                int nextcol;
-                zone = 10;
-                nextcol = ((print_col / zone) + 1) * zone;
-                if (nextcol < print_col) {
-                    nextcol = print_col;
-                }
-                print_spaces(nextcol - print_col);
-            }
-            (*p)++;
-        } else {
-            newline = 1;
-            break;
-        }
+    return ctx->error;
+}
+
+int basic_set_num(struct interp *ctx, const char *name, double value)
+{
+    struct var *v;
+    struct value num;
+    v = named_var(ctx, name);
+    if (!v || v->is_string) {
+        return 0;
     }
-    if (newline) {
-        fputc('\n', stdout);
-        print_col = 0;
+    if (v->is_int) {
+        num = make_num(value);
+        return num_to_intvar(ctx, &num, &v->scalar.u.ival);
     }
-    fflush(stdout);
+    v->scalar.u.num = value;
+    return 1;
 }
 
-static void statement_input(char **p)
+int basic_get_num(struct interp *ctx, const char *name, double *value)
 {
-    char prompt[MAX_STR_LEN];
-    char linebuf[MAX_LINE_LEN];
-    int first_prompt;
-    struct value *vp;
-    int is_array;
-    int is_string;
+    struct var *v;
+    v = named_var(ctx, name);
+    if (!v || v->is_string) {
+        return 0;
+    }
+    *value = v->is_int ? (double)v->scalar.u.ival : v->scalar.u.num;
+    return 1;
+}
 
-    prompt[0] = '\0';
-    skip_spaces(p);
-    first_prompt = 1;
-    if (**p == '\"') {
-        struct value s;
-        s = eval_factor(p);
-        ensure_str(&s);
-        strncpy(prompt, s.str, sizeof(prompt) - 1);
-        prompt[sizeof(prompt) - 1] = '\0';
-        skip_spaces(p);
-        if (**p == ';' || **p == ',') {
-            (*p)++;
-        }
+int basic_set_str(struct interp *ctx, const char *name, const char *s)
+{
+    struct var *v;
+    struct value str;
+    int len;
+    v = named_var(ctx, name);
+    if (!v || !v->is_string) {
+        return 0;
     }
-    for (;;) {
-        skip_spaces(p);
-        if (**p == '\0' || **p == ':') {
-            break;
-        }
-        if (!isalpha((unsigned char)**p)) {
-            runtime_error("Expected variable in INPUT");
-            return;
-        }
-        vp = get_var_reference(p, &is_array, &is_string);
-        if (!vp) {
-            return;
-        }
-        if (prompt[0] != '\0' && first_prompt) {
-            printf("%s", prompt);
-        }
-        printf("? ");
-        fflush(stdout);
-        if (!fgets(linebuf, sizeof(linebuf), stdin)) {
-            runtime_error("Unexpected end of input");
-            return;
-        }
-        trim_newline(linebuf);
-        if (is_string) {
-            *vp = make_str(linebuf);
-        } else {
-            *vp = make_num(atof(linebuf));
-        }
-        skip_spaces(p);
-        if (**p == ',') {
-            (*p)++;
-            first_prompt = 0;
-            continue;
-        }
-        break;
+    len = (int)strlen(s);
+    str = make_str_len(ctx, s, len);
+    if (str.len != len) {
+        return 0;
     }
+    v->scalar = str;
+    return 1;
 }
 
-static void statement_let(char **p)
+int basic_get_str(struct interp *ctx, const char *name, char *buf, int size)
 {
-    struct value *vp;
-    struct value rhs;
-    int is_array;
-    int is_string;
+    struct var *v;
+    int n;
+    v = named_var(ctx, name);
+    if (!v || !v->is_string) {
+        return -1;
+    }
+    if (size > 0) {
+        n = v->scalar.len < size ? v->scalar.len : size - 1;
+        memcpy(buf, v->scalar.u.str, n);
+        buf[n] = '\0';
+    }
+    return v->scalar.len;
+}
+
+#ifndef BASIC_NO_MAIN
+/* Program image: the crunched program saved by -c so later runs can skip
+ * loading the source.  Crunched code holds no pointers, so the image is
+ * a header, the DATA, line and variable tables (in that order, so each
+ * stays aligned), and the code itself, in native byte order.  The header
+ * records the source file's size and mtime; an image that does not match
+ * them, was written by a different build or fails the checks in
+ * image_tables_valid() is ignored.  Bump IMAGE_VERSION whenever the
+ * token format changes. */
+#define IMAGE_VERSION 8
+
+struct image_header {
+    char magic[4];
+    int version;
+    int int_size;
+    int double_size;
+    long src_size;
+    long src_mtime;
+    int line_count;
+    int var_count;
+    int data_count;
+    long code_len;
+};
+
+struct image_line {
+    int number;
+    int data_index;
+    long offset;
+};
+
+struct image_var {
+    char name1;
+    char name2;
+    char type;
+    char pad;
+};
+
+struct image_data {
+    long offset;
+    int len;
+    int is_num;
+    struct value num;
+};
+
+/* Name of the image for a source file: the same path with "c" added. */
+static char *image_path(const char *path)
+{
+    char *name;
+    name = (char *)malloc(strlen(path) + 2);
+    if (name) {
+        strcpy(name, path);
+        strcat(name, "c");
+    }
+    return name;
+}
+
+/* Length of a crunched line including its terminating 0 byte. */
+static long code_length(unsigned char *code)
+{
+    unsigned char *p;
+    p = code;
+    skip_to_eol(&p);
+    return (long)(p - code) + 1;
+}
 
-    vp = get_var_reference(p, &is_array, &is_string);
-    if (!vp) {
+/* Write the loaded program to `image'.  Failure only costs later runs
+ * the shortcut, so it is reported and otherwise ignored. */
+static void write_image(struct interp *ctx, const char *path, const char *image)
+{
+    FILE *f;
+    struct stat st;
+    struct image_header h;
+    struct image_line il;
+    struct image_var iv;
+    struct image_data id;
+    long offset;
+    int i, j;
+    if (stat(path, &st) != 0) {
         return;
     }
-    skip_spaces(p);
-    if (**p != '=') {
-        runtime_error("Expected '='");
+    f = fopen(image, "wb");
+    if (!f) {
+        fprintf(ctx->err, "Cannot write %s\n", image);
         return;
     }
-    (*p)++;
-    rhs = eval_or_expr(p);
-    if (is_string) {
-        ensure_str(&rhs);
-        rhs.type = VAL_STR;
-    } else {
-        ensure_num(&rhs);
-        rhs.type = VAL_NUM;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "BIMG", 4);
+    h.version = IMAGE_VERSION;
+    h.int_size = (int)sizeof(int);
+    h.double_size = (int)sizeof(double);
+    h.src_size = (long)st.st_size;
+    h.src_mtime = (long)st.st_mtime;
+    h.line_count = ctx->line_count;
+    h.var_count = ctx->var_count;
+    h.data_count = ctx->data_count;
+    h.code_len = 0;
+    for (i = 0; i < ctx->line_count; i++) {
+        h.code_len += code_length(ctx->program_lines[i].code);
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    /* An item's text lies in the code of the line that holds it */
+    offset = 0;
+    j = 0;
+    for (i = 0; i < ctx->line_count; i++) {
+        int end;
+        end = i + 1 < ctx->line_count ? ctx->program_lines[i + 1].data_index : ctx->data_count;
+        for (; j < end; j++) {
+            memset(&id, 0, sizeof(id));
+            id.offset = offset + (long)((unsigned char *)ctx->data_pool[j].text.u.str - ctx->program_lines[i].code);
+            id.len = ctx->data_pool[j].text.len;
+            id.is_num = ctx->data_pool[j].is_num;
+            id.num = ctx->data_pool[j].num;
+            fwrite(&id, sizeof(id), 1, f);
+        }
+        offset += code_length(ctx->program_lines[i].code);
+    }
+    offset = 0;
+    for (i = 0; i < ctx->line_count; i++) {
+        il.number = ctx->program_lines[i].number;
+        il.data_index = ctx->program_lines[i].data_index;
+        il.offset = offset;
+        fwrite(&il, sizeof(il), 1, f);
+        offset += code_length(ctx->program_lines[i].code);
+    }
+    for (i = 0; i < ctx->var_count; i++) {
+        iv.name1 = ctx->vars[i].name1;
+        iv.name2 = ctx->vars[i].name2;
+        iv.type = (char)(ctx->vars[i].is_string ? VAL_STR : ctx->vars[i].is_int ? VAL_INT : VAL_NUM);
+        iv.pad = 0;
+        fwrite(&iv, sizeof(iv), 1, f);
+    }
+    for (i = 0; i < ctx->line_count; i++) {
+        fwrite(ctx->program_lines[i].code, 1, (size_t)code_length(ctx->program_lines[i].code), f);
+    }
+    if (ferror(f) | fclose(f)) {
+        fprintf(ctx->err, "Cannot write %s\n", image);
+        unlink(image);
+    }
+}
+
+/* Check the compiled expression in [pc, end) of an image: operands in
+ * bounds and slots valid, and the evaluation stack neither underflowed
+ * nor grown past EVAL_STACK. */
+static int image_expr_valid(struct image_header *h, unsigned char *pc, unsigned char *end)
+{
+    int depth;
+    int need;
+    int size;
+    int n;
+    depth = 0;
+    while (pc < end) {
+        need = 0;
+        n = 1;
+        switch (*pc) {
+        case OP_INUM:
+            size = 3;
+            break;
+        case OP_NUM:
+            size = 1 + (int)sizeof(double);
+            break;
+        case OP_STR:
+            size = end - pc < 3 ? 3 : 3 + (int)get_u16(pc + 1);
+            break;
+        case OP_VAR:
+            size = 3;
+            break;
+        case OP_ELEM:
+            size = 4;
+            break;
+        case OP_FUNC:
+            size = 3;
+            break;
+        case OP_AFUNC:
+            size = 6;
+            break;
+        case OP_ERROR:
+            size = 2;
+            n = 0;
+            break;
+        case OP_NEG:
+        case OP_POS:
+            size = 1;
+            need = 1;
+            n = 0;
+            break;
+        default:
+            if (*pc < OP_POW || *pc > OP_OR) {
+                return 0;
+            }
+            size = 1;
+            need = 2;
+            n = -1;
+            break;
+        }
+        if (size > end - pc) {
+            return 0;
+        }
+        switch (*pc) {
+        case OP_VAR:
+            if (get_u16(pc + 1) >= (unsigned)h->var_count) {
+                return 0;
+            }
+            break;
+        case OP_ELEM:
+            if (get_u16(pc + 1) >= (unsigned)h->var_count || pc[3] < 1 || pc[3] > MAX_DIMS) {
+                return 0;
+            }
+            need = pc[3];
+            n = 1 - pc[3];
+            break;
+        case OP_FUNC:
+            need = pc[2];
+            n = 1 - pc[2];
+            break;
+        case OP_AFUNC:
+            if (pc[1] < TOK_FIRST_ARRAY_FUNC || pc[1] > TOK_LAST_FUNC ||
+                get_u16(pc + 2) >= (unsigned)h->var_count ||
+                get_u16(pc + 4) >= (unsigned)h->var_count) {
+                return 0;
+            }
+            if (pc[1] == TOK_FIND) {
+                need = 1;
+                n = 0;
+            }
+            break;
+        case OP_ERROR:
+            if (pc[1] >= sizeof(compile_errors) / sizeof(compile_errors[0])) {
+                return 0;
+            }
+            break;
+        }
+        if (depth < need || depth + n > EVAL_STACK) {
+            return 0;
+        }
+        depth += n;
+        pc += size;
     }
-    *vp = rhs;
+    return 1;
 }
 
-static void statement_goto(char **p)
+/* Length of the token at `p' in image code ending at `end', or 0 if it
+ * would reach the end, which must be left for a line's 0 byte. */
+static long image_token_size(unsigned char *p, unsigned char *end)
 {
-    int line_number;
-    skip_spaces(p);
-    line_number = atoi(*p);
-    while (**p && isdigit((unsigned char)**p)) {
-        (*p)++;
-    }
-    current_line = find_line_index(line_number);
-    if (current_line < 0) {
-        runtime_error("Target line not found");
-        return;
+    long size;
+    if (*p == TOK_STR || *p == TOK_DATA || *p == TOK_EXPR) {
+        size = end - p > 3 ? 3 + (long)get_u16(p + 1) : end - p;
+    } else {
+        size = skip_token(p) - p;
     }
-    statement_pos = NULL;
+    return size < end - p ? size : 0;
 }
 
-static void statement_gosub(char **p)
+/* Check the crunched code of an image token by token, as load_program()
+ * would have produced it: every line ends inside the code, every variable
+ * slot, line index and expression is valid, and IF skips and ON tables
+ * land on a token of their own line. */
+static int image_code_valid(struct image_header *h, struct image_line *il, unsigned char *code)
 {
-    int target;
-    char *return_pos;
-
-    if (gosub_top >= MAX_GOSUB) {
-        runtime_error("GOSUB stack overflow");
-        return;
+    unsigned char *start;   /* token starts, and line ends */
+    unsigned char *p;
+    unsigned char *end;
+    unsigned char *q;
+    long target;
+    long size;
+    int ok;
+    int i;
+    if (h->code_len == 0) {
+        return 1;
     }
-    skip_spaces(p);
-    target = atoi(*p);
-    while (**p && isdigit((unsigned char)**p)) {
-        (*p)++;
+    start = (unsigned char *)calloc((size_t)h->code_len, 1);
+    if (!start) {
+        return 0;
     }
-    return_pos = *p;
-    gosub_stack[gosub_top].line_index = current_line;
-    gosub_stack[gosub_top].position = return_pos;
-    gosub_top++;
-    current_line = find_line_index(target);
-    if (current_line < 0) {
-        runtime_error("Target line not found");
-        return;
+    end = code + h->code_len;
+    ok = 1;
+    for (i = 0; ok && i < h->line_count; i++) {
+        for (p = code + il[i].offset; *p; p += size) {
+            start[p - code] = 1;
+            size = image_token_size(p, end);
+            if (size == 0 ||
+                (*p == TOK_VAR && get_u16(p + 1) >= (unsigned)h->var_count) ||
+                (*p == TOK_LINE && get_u16(p + 3) != NO_LINE &&
+                 get_u16(p + 3) >= (unsigned)h->line_count) ||
+                (*p == TOK_EXPR && !image_expr_valid(h, p + 3, p + size))) {
+                ok = 0;
+                break;
+            }
+        }
+        if (ok) {
+            start[p - code] = 1;
+        }
     }
-    statement_pos = NULL;
-}
-
-static void statement_return(char **p)
-{
-    (void)p;  /* Unused parameter */
-    if (gosub_top <= 0) {
-        runtime_error("RETURN without GOSUB");
-        return;
+    /* Second pass, now that every token start is known */
+    for (i = 0; ok && i < h->line_count; i++) {
+        for (p = code + il[i].offset; ok && *p; p = skip_token(p)) {
+            target = -1;
+            if (*p == TOK_IF) {
+                target = (p - code) + 3 + get_u16(p + 1);
+            } else if (*p == TOK_ON) {
+                q = p + 3;
+                if (*q == TOK_EXPR) {
+                    q = skip_token(q);
+                }
+                target = (q - code) + (long)get_u16(p + 1) * ON_ENTRY;
+            }
+            if (target >= 0) {
+                /* The target must be a token of this line, or its end */
+                ok = target < h->code_len && start[target];
+                for (q = p; ok && q < code + target; q = skip_token(q)) {
+                    if (*q == '\0') {
+                        ok = 0;
+                    }
+                }
+                ok = ok && q == code + target;
+            }
+            if (ok && *p == TOK_ON) {
+                /* Each entry must be a real TOK_LINE */
+                q = p + 3;
+                if (*q == TOK_EXPR) {
+                    q = skip_token(q);
+                }
+                for (size = 0; ok && size < (long)get_u16(p + 1); size++) {
+                    ok = start[(q - code) + 1 + size * ON_ENTRY] &&
+                         q[1 + size * ON_ENTRY] == TOK_LINE;
+                }
+            }
+        }
     }
-    gosub_top--;
-    current_line = gosub_stack[gosub_top].line_index;
-    statement_pos = gosub_stack[gosub_top].position;
+    free(start);
+    return ok;
 }
 
-static void statement_if(char **p)
+/* Check that every table entry of an image refers to something inside
+ * its code, which must end a line, and that the variables are distinct
+ * valid names, so a corrupted image is rejected instead of read out of
+ * bounds. */
+static int image_tables_valid(struct image_header *h, struct image_line *il,
+                              struct image_var *iv, struct image_data *id,
+                              unsigned char *code)
 {
-    int cond_true;
-
-    cond_true = eval_condition(p);
-    skip_spaces(p);
-    if (!starts_with_kw(*p, "THEN")) {
-        runtime_error("Missing THEN");
-        return;
+    unsigned char seen[26 * VAR_NAME2_CODES * 3];
+    int key;
+    int i;
+    if (h->code_len > 0 && code[h->code_len - 1] != '\0') {
+        return 0;
     }
-    *p += 4;
-    skip_spaces(p);
-    if (!cond_true) {
-        /* Skip rest of line */
-        *p += strlen(*p);
-        return;
+    for (i = 0; i < h->line_count; i++) {
+        if (il[i].offset < 0 || il[i].offset >= h->code_len ||
+            (il[i].offset > 0 && code[il[i].offset - 1] != '\0') ||
+            il[i].data_index < 0 || il[i].data_index > h->data_count) {
+            return 0;
+        }
     }
-    if (isdigit((unsigned char)**p)) {
-        int target;
-        target = atoi(*p);
-        while (**p && isdigit((unsigned char)**p)) {
-            (*p)++;
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < h->var_count; i++) {
+        if (iv[i].name1 < 'A' || iv[i].name1 > 'Z' ||
+            (iv[i].type != VAL_NUM && iv[i].type != VAL_STR && iv[i].type != VAL_INT)) {
+            return 0;
         }
-        current_line = find_line_index(target);
-        if (current_line < 0) {
-            runtime_error("Target line not found");
-            return;
+        key = var_name_key(iv[i].name1, iv[i].name2, iv[i].type);
+        if (seen[key]) {
+            return 0;
+        }
+        seen[key] = 1;
+    }
+    for (i = 0; i < h->data_count; i++) {
+        if (id[i].offset < 0 || id[i].len < 0 || id[i].offset > h->code_len - id[i].len) {
+            return 0;
         }
-        statement_pos = NULL;
-    } else {
-        /* Execute rest of line inline */
-        skip_spaces(p);
-        statement_pos = *p;
     }
+    return image_code_valid(h, il, code);
 }
 
-static void statement_for(char **p)
+/* Load the program from `image' if it is current for source `path',
+ * with a single read.  Returns 0, having changed nothing, when the image
+ * is missing, stale or unusable. */
+static int load_image(struct interp *ctx, const char *path, const char *image)
 {
-    struct value *vp;
-    struct value startv, endv, stepv;
-    int is_array;
-    int is_string;
-    if (for_top >= MAX_FOR) {
-        runtime_error("FOR stack overflow");
-        return;
+    FILE *f;
+    struct stat src, st;
+    struct image_header h;
+    struct image_line *il;
+    struct image_var *iv;
+    struct image_data *id;
+    char *buf;
+    unsigned char *code;
+    long size;
+    int i;
+    if (stat(path, &src) != 0 || stat(image, &st) != 0 || st.st_mtime < src.st_mtime) {
+        return 0;
     }
-    vp = get_var_reference(p, &is_array, &is_string);
-    if (!vp) {
-        return;
+    f = fopen(image, "rb");
+    if (!f) {
+        return 0;
     }
-    if (is_array) {
-        runtime_error("FOR variable must be scalar");
-        return;
+    size = (long)st.st_size;
+    if (size < (long)sizeof(h)) {
+        fclose(f);
+        return 0;
     }
-    if (is_string) {
-        runtime_error("FOR variable must be numeric");
-        return;
+    buf = (char *)malloc((size_t)size);
+    if (!buf) {
+        fclose(f);
+        return 0;
     }
-    skip_spaces(p);
-    if (**p != '=') {
-        runtime_error("Expected '=' in FOR");
-        return;
+    if ((long)fread(buf, 1, (size_t)size, f) != size) {
+        free(buf);
+        fclose(f);
+        return 0;
     }
-    (*p)++;
-    startv = eval_or_expr(p);
-    ensure_num(&startv);
-    skip_spaces(p);
-    if (!starts_with_kw(*p, "TO")) {
-        runtime_error("Expected TO in FOR");
-        return;
+    fclose(f);
+    memcpy(&h, buf, sizeof(h));
+    if (memcmp(h.magic, "BIMG", 4) != 0 || h.version != IMAGE_VERSION ||
+        h.int_size != (int)sizeof(int) || h.double_size != (int)sizeof(double) ||
+        h.src_size != (long)src.st_size || h.src_mtime != (long)src.st_mtime ||
+        h.line_count < 0 || h.line_count > MAX_LINES ||
+        h.var_count < 0 || h.var_count > MAX_VARS || h.data_count < 0 ||
+        h.code_len < 0 ||
+        size != (long)sizeof(h) + h.line_count * (long)sizeof(struct image_line) +
+                h.var_count * (long)sizeof(struct image_var) +
+                h.data_count * (long)sizeof(struct image_data) + h.code_len) {
+        free(buf);
+        return 0;
     }
-    *p += 2;
-    endv = eval_or_expr(p);
-    ensure_num(&endv);
-    skip_spaces(p);
-    if (starts_with_kw(*p, "STEP")) {
-        *p += 4;
-        stepv = eval_or_expr(p);
-        ensure_num(&stepv);
-    } else {
-        stepv = make_num(1.0);
-    }
-    *vp = startv;
-    for_stack[for_top].name1 = ' ';
-    for_stack[for_top].name2 = ' ';
-    if (var_count > 0) {
-        /* Recover name from vp by searching var table */
-        int i;
-        for (i = 0; i < var_count; i++) {
-            if (&vars[i].scalar == vp || (vars[i].is_array && vp >= vars[i].array && vp < vars[i].array + vars[i].size)) {
-                for_stack[for_top].name1 = vars[i].name1;
-                for_stack[for_top].name2 = vars[i].name2;
-                break;
-            }
-        }
+    id = (struct image_data *)(buf + sizeof(h));
+    il = (struct image_line *)(id + h.data_count);
+    iv = (struct image_var *)(il + h.line_count);
+    code = (unsigned char *)(iv + h.var_count);
+    if (!image_tables_valid(&h, il, iv, id, code)) {
+        free(buf);
+        return 0;
     }
-    for_stack[for_top].end_value = endv.num;
-    for_stack[for_top].step = stepv.num;
-    for_stack[for_top].line_index = current_line;
-    for_stack[for_top].resume_pos = *p;
-    for_stack[for_top].var = vp;
-    for_stack[for_top].is_string = is_string;
-    for_top++;
-}
-
-static void statement_next(char **p)
-{
-    char namebuf[16];
-    char n1, n2;
-    int i;
-    struct value *vp;
-    int is_string;
-    skip_spaces(p);
-    if (isalpha((unsigned char)**p)) {
-        read_identifier(p, namebuf, sizeof(namebuf));
-    } else {
-        namebuf[0] = '\0';
+    ctx->program_lines = (struct line *)malloc((h.line_count ? h.line_count : 1) * sizeof(struct line));
+    ctx->data_pool = (struct data_item *)malloc((h.data_count ? h.data_count : 1) * sizeof(struct data_item));
+    if (!ctx->program_lines || !ctx->data_pool) {
+        free(ctx->program_lines);
+        free(ctx->data_pool);
+        ctx->program_lines = NULL;
+        ctx->data_pool = NULL;
+        free(buf);
+        return 0;
     }
-    uppercase_name(namebuf, &n1, &n2, &is_string);
-    for (i = for_top - 1; i >= 0; i--) {
-        if (namebuf[0] == '\0' || (for_stack[i].name1 == n1 && for_stack[i].name2 == n2)) {
-            break;
-        }
+    /* The code stays in the image buffer for the life of the program */
+    ctx->image_buf = buf;
+    for (i = 0; i < h.line_count; i++) {
+        ctx->program_lines[i].number = il[i].number;
+        ctx->program_lines[i].data_index = il[i].data_index;
+        ctx->program_lines[i].code = code + il[i].offset;
     }
-    if (i < 0) {
-        runtime_error("NEXT without FOR");
-        return;
+    ctx->line_count = ctx->line_capacity = h.line_count;
+    for (i = 0; i < h.var_count; i++) {
+        find_or_create_var(ctx, iv[i].name1, iv[i].name2, iv[i].type);
     }
-    for_top = i + 1;
-    vp = for_stack[for_top - 1].var;
-    if (!vp) {
-        runtime_error("Loop variable missing");
-        return;
+    for (i = 0; i < h.data_count; i++) {
+        ctx->data_pool[i].text = make_str_ref((char *)code + id[i].offset, id[i].len);
+        ctx->data_pool[i].is_num = id[i].is_num;
+        ctx->data_pool[i].num = id[i].num;
     }
-    vp->num += for_stack[for_top - 1].step;
-    if ((for_stack[for_top - 1].step >= 0 && vp->num <= for_stack[for_top - 1].end_value) ||
-        (for_stack[for_top - 1].step < 0 && vp->num >= for_stack[for_top - 1].end_value)) {
-        current_line = for_stack[for_top - 1].line_index;
-        statement_pos = for_stack[for_top - 1].resume_pos;
-    } else {
-        for_top--;
+    ctx->data_count = ctx->data_cap = h.data_count;
+    ctx->data_next = 0;
+    return 1;
+}
+
+/* Allocate the per-line counters once the program is loaded. */
+static void profile_start(struct interp *ctx)
+{
+    free(ctx->prof_hits);
+    free(ctx->prof_line_stmts);
+    free(ctx->prof_time);
+    memset(ctx->prof_stmt, 0, sizeof(ctx->prof_stmt));
+    ctx->prof_total = 0;
+    ctx->prof_last_line = -1;
+    ctx->prof_prev_line = -1;
+    ctx->prof_prev_pos = NULL;
+    ctx->prof_hits = (long *)calloc(ctx->line_count ? ctx->line_count : 1, sizeof(long));
+    ctx->prof_line_stmts = (long *)calloc(ctx->line_count ? ctx->line_count : 1, sizeof(long));
+    ctx->prof_time = (double *)calloc(ctx->line_count ? ctx->line_count : 1, sizeof(double));
+    if (!ctx->prof_hits || !ctx->prof_line_stmts || !ctx->prof_time) {
+        fprintf(ctx->err, "Out of memory for profile\n");
+        ctx->profiling = 0;
+        return;
     }
+    ctx->prof_last_clock = clock();
 }
 
-static void statement_dim(char **p)
+/* Spelling of a keyword token, for reports. */
+static const char *keyword_name(int tok)
 {
-    for (;;) {
-        char namebuf[16];
-        char n1, n2;
-        int is_string;
-        int size;
-        struct var *v;
-        struct value sizev;
-        skip_spaces(p);
-        if (!isalpha((unsigned char)**p)) {
-            runtime_error("Expected array name");
-            return;
-        }
-        read_identifier(p, namebuf, sizeof(namebuf));
-        uppercase_name(namebuf, &n1, &n2, &is_string);
-        skip_spaces(p);
-        if (**p != '(') {
-            runtime_error("DIM requires size");
-            return;
-        }
-        (*p)++;
-        sizev = eval_or_expr(p);
-        ensure_num(&sizev);
-        size = (int)sizev.num + 1;
-        if (size <= 0) {
-            runtime_error("Invalid array size");
-            return;
-        }
-        skip_spaces(p);
-        if (**p != ')') {
-            runtime_error("Missing ')'");
-            return;
-        }
-        (*p)++;
-        v = find_or_create_var(n1, n2, is_string, 1, size);
-        (void)v;
-        skip_spaces(p);
-        if (**p == ',') {
-            (*p)++;
-            continue;
+    int i;
+    for (i = 0; keywords[i].name; i++) {
+        if (keywords[i].token == tok) {
+            return keywords[i].name;
         }
-        break;
     }
+    return "?";
 }
 
-static void execute_statement(char **p)
+/* One line of the report */
+struct prof_entry {
+    int line;
+    long stmts;
+    double time;
+};
+
+/* qsort() order for the report: hottest line first.  Times are all zero
+ * unless -pt is in effect. */
+static int compare_profile(const void *a, const void *b)
 {
-    skip_spaces(p);
-    if (**p == '\0') {
-        return;
-    }
-    if (starts_with_kw(*p, "REM")) {
-        statement_rem(p);
-        return;
-    }
-    if (**p == '\'') {
-        statement_rem(p);
-        return;
-    }
-    if (starts_with_kw(*p, "PRINT") || **p == '?') {
-        if (**p == '?') {
-            (*p)++;
-        } else {
-            *p += 5;
-        }
-        statement_print(p);
-        return;
+    const struct prof_entry *pa, *pb;
+    pa = (const struct prof_entry *)a;
+    pb = (const struct prof_entry *)b;
+    if (pa->time != pb->time) {
+        return pa->time > pb->time ? -1 : 1;
     }
-    if (starts_with_kw(*p, "INPUT")) {
-        *p += 5;
-        statement_input(p);
-        return;
+    if (pa->stmts != pb->stmts) {
+        return pa->stmts > pb->stmts ? -1 : 1;
     }
-    if (starts_with_kw(*p, "LET")) {
-        *p += 3;
-        statement_let(p);
+    return pa->line - pb->line;
+}
+
+/* Print the hot-line and statement report to ctx->err. */
+static void profile_report(struct interp *ctx)
+{
+    struct prof_entry *order;
+    int i, n;
+    double total_time;
+    if (!ctx->profiling) {
         return;
     }
-    if (starts_with_kw(*p, "GOTO")) {
-        *p += 4;
-        statement_goto(p);
-        return;
+    if (ctx->profile_time && ctx->prof_last_line >= 0) {
+        ctx->prof_time[ctx->prof_last_line] += (double)(clock() - ctx->prof_last_clock) / CLOCKS_PER_SEC;
+        ctx->prof_last_line = -1;
     }
-    if (starts_with_kw(*p, "GOSUB")) {
-        *p += 5;
-        statement_gosub(p);
+    order = (struct prof_entry *)malloc((ctx->line_count ? ctx->line_count : 1) * sizeof(struct prof_entry));
+    if (!order) {
         return;
     }
-    if (starts_with_kw(*p, "RETURN")) {
-        *p += 6;
-        statement_return(p);
-        return;
+    n = 0;
+    total_time = 0.0;
+    for (i = 0; i < ctx->line_count; i++) {
+        if (ctx->prof_line_stmts[i]) {
+            order[n].line = i;
+            order[n].stmts = ctx->prof_line_stmts[i];
+            order[n].time = ctx->prof_time[i];
+            n++;
+            total_time += ctx->prof_time[i];
+        }
     }
-    if (starts_with_kw(*p, "IF")) {
-        *p += 2;
-        statement_if(p);
-        return;
+    qsort(order, n, sizeof(struct prof_entry), compare_profile);
+    fprintf(ctx->err, "Profile: %ld statements\n", ctx->prof_total);
+    fprintf(ctx->err, "%8s %10s %10s %6s", "line", "hits", "stmts", "%");
+    if (ctx->profile_time) {
+        fprintf(ctx->err, " %10s %6s", "cpu(s)", "%");
+    }
+    fputc('\n', ctx->err);
+    for (i = 0; i < n && i < PROFILE_LINES; i++) {
+        int l;
+        l = order[i].line;
+        fprintf(ctx->err, "%8d %10ld %10ld %6.2f", ctx->program_lines[l].number, ctx->prof_hits[l],
+                ctx->prof_line_stmts[l], 100.0 * ctx->prof_line_stmts[l] / ctx->prof_total);
+        if (ctx->profile_time) {
+            fprintf(ctx->err, " %10.4f %6.2f", ctx->prof_time[l],
+                    total_time > 0.0 ? 100.0 * ctx->prof_time[l] / total_time : 0.0);
+        }
+        fputc('\n', ctx->err);
     }
-    if (starts_with_kw(*p, "FOR")) {
-        *p += 3;
-        statement_for(p);
-        return;
+    fprintf(ctx->err, "%8s %10s\n", "stmt", "stmts");
+    for (i = 0x80; i < 256; i++) {
+        if (ctx->prof_stmt[i]) {
+            fprintf(ctx->err, "%8s %10ld\n", keyword_name(i), ctx->prof_stmt[i]);
+        }
     }
-    if (starts_with_kw(*p, "NEXT")) {
-        *p += 4;
-        statement_next(p);
+    free(order);
+}
+
+/* Print the run statistics to the error stream, for -t. */
+static void stats_report(struct interp *ctx)
+{
+    double secs;
+    if (!ctx->stats) {
         return;
     }
-    if (starts_with_kw(*p, "DIM")) {
-        *p += 3;
-        statement_dim(p);
-        return;
+    secs = stat_value(ctx, BASIC_STAT_SECONDS);
+    fprintf(ctx->err, "Statistics:\n");
+    fprintf(ctx->err, "%14s %10ld", "statements", ctx->stat_statements);
+    if (secs > 0.0) {
+        fprintf(ctx->err, " (%.0f per second)", ctx->stat_statements / secs);
+    }
+    fputc('\n', ctx->err);
+    fprintf(ctx->err, "%14s %10.2f\n", "seconds", secs);
+    fprintf(ctx->err, "%14s %10ld\n", "GOTO", ctx->stat_gotos);
+    fprintf(ctx->err, "%14s %10ld\n", "GOSUB", ctx->stat_gosubs);
+    fprintf(ctx->err, "%14s %10d\n", "FOR depth", ctx->stat_for_peak);
+    fprintf(ctx->err, "%14s %10d\n", "GOSUB depth", ctx->stat_gosub_peak);
+    fprintf(ctx->err, "%14s %10ld\n", "variables", ctx->stat_vars);
+    fprintf(ctx->err, "%14s %10ld\n", "array resizes", ctx->stat_resizes);
+    fprintf(ctx->err, "%14s %10ld\n", "string bytes", ctx->stat_str_bytes);
+    fprintf(ctx->err, "%14s %10ld\n", "string peak", ctx->stat_str_peak);
+}
+
+#ifdef HAVE_SOCKETS
+/* -s: keep the loaded program resident and run it once per connection
+ * to a Unix socket at `path'.  The connection is the run's standard
+ * input, output and error; -b/-u/-n apply as given, otherwise it counts
+ * as a pipe.  Only returns if the socket cannot be served. */
+static int serve(struct interp *ctx, const char *path)
+{
+    struct sockaddr_un addr;
+    int listener;
+    int conn;
+    int saved[3];
+    int fd;
+    int out_mode;
+    int batch_mode;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(ctx->err, "%s: socket path too long\n", path);
+        return 1;
     }
-    if (starts_with_kw(*p, "SLEEP")) {
-        *p += 5;
-        statement_sleep(p);
-        return;
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("socket");
+        return 1;
     }
-    if (starts_with_kw(*p, "END") || starts_with_kw(*p, "STOP")) {
-        halted = 1;
-        *p += strlen(*p);
-        return;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 8) < 0) {
+        perror(path);
+        close(listener);
+        return 1;
     }
-    /* Default to LET style assignment */
-    if (isalpha((unsigned char)**p)) {
-        statement_let(p);
-        return;
+    /* A client that goes away early must not take the server with it */
+    signal(SIGPIPE, SIG_IGN);
+    out_mode = ctx->out_interactive;
+    batch_mode = ctx->input_batch;
+    for (fd = 0; fd < 3; fd++) {
+        saved[fd] = dup(fd);
     }
-    runtime_error("Unknown statement");
-}
-
-static void sort_program(void)
-{
-    int i, j;
-    for (i = 0; i < line_count; i++) {
-        for (j = i + 1; j < line_count; j++) {
-            if (program_lines[j]->number < program_lines[i]->number) {
-                struct line *tmp;
-                tmp = program_lines[i];
-                program_lines[i] = program_lines[j];
-                program_lines[j] = tmp;
+    for (;;) {
+        conn = accept(listener, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            perror("accept");
+            break;
         }
+        for (fd = 0; fd < 3; fd++) {
+            dup2(conn, fd);
+        }
+        close(conn);
+        ctx->out_interactive = out_mode < 0 ? 0 : out_mode;
+        ctx->input_batch = batch_mode < 0 ? 1 : batch_mode;
+        reset_run_state(ctx);
+        if (ctx->profiling) {
+            profile_start(ctx);
+        }
+        run_program(ctx);
+        out_flush(ctx);
+        profile_report(ctx);
+        stats_report(ctx);
+        fflush(ctx->err);
+        for (fd = 0; fd < 3; fd++) {
+            dup2(saved[fd], fd);
+        }
+        clearerr(stdout);
     }
+    close(listener);
+    return 1;
 }
+#endif
+
+#ifdef HAVE_PTHREADS
+/* One input file of a -j batch and, once its run is done, the output and
+ * error messages it produced */
+struct batch_job {
+    const char *path;
+    char *out;
+    size_t out_len;
+    char *err;
+    size_t err_len;
+    int failed;             /* the input could not be opened */
+    int done;
+};
+
+/* A -j batch.  Workers take jobs in order by atomically incrementing
+ * `next', so handing out work never locks; `lock' and `finished' only
+ * let the writer sleep until the job it must print next is done. */
+struct batch {
+    struct batch_job *jobs;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+};
+
+/* A worker thread and the interpreter it runs every job on */
+struct batch_worker {
+    struct batch *batch;
+    struct interp *ctx;
+    pthread_t thread;
+};
 
-static int find_line_index(int number)
+/* Run the program once with `job' as its input, collecting what it
+ * writes in memory. */
+static void batch_run(struct interp *ctx, struct batch_job *job)
 {
-    int i;
-    for (i = 0; i < line_count; i++) {
-        if (program_lines[i] && program_lines[i]->number == number) {
-            return i;
-        }
+    FILE *out;
+    FILE *err;
+    int fd;
+    out = open_memstream(&job->out, &job->out_len);
+    err = open_memstream(&job->err, &job->err_len);
+    if (!out || !err) {
+        fprintf(stderr, "%s: out of memory\n", job->path);
+        if (out) fclose(out);
+        if (err) fclose(err);
+        job->failed = 1;
+        return;
     }
-    return -1;
+    fd = open(job->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(err, "%s: %s\n", job->path, strerror(errno));
+        job->failed = 1;
+    } else {
+        reset_run_state(ctx);
+        ctx->in_fd = fd;
+        ctx->out = out;
+        ctx->err = err;
+        if (ctx->profiling) {
+            profile_start(ctx);
+        }
+        run_program(ctx);
+        out_flush(ctx);
+        profile_report(ctx);
+        stats_report(ctx);
+        ctx->in_fd = 0;
+        ctx->out = stdout;
+        ctx->err = stderr;
+        close(fd);
+    }
+    fclose(out);
+    fclose(err);
 }
 
-static void add_or_replace_line(int number, const char *text)
+/* Worker thread: run jobs until the queue is empty. */
+static void *batch_thread(void *arg)
 {
-    int i;
-    for (i = 0; i < line_count; i++) {
-        if (program_lines[i] && program_lines[i]->number == number) {
-            if (program_lines[i]->text) {
-                free(program_lines[i]->text);
-            }
-            program_lines[i]->text = dupstr_local(text);
-            return;
-        }
-    }
-    if (line_count >= MAX_LINES) {
-        runtime_error("Program too large");
-        return;
-    }
-    program_lines[line_count] = (struct line *)malloc(sizeof(struct line));
-    if (!program_lines[line_count]) {
-        runtime_error("Out of memory");
-        return;
-    }
-    program_lines[line_count]->number = number;
-    program_lines[line_count]->text = dupstr_local(text);
-    line_count++;
+    struct batch_worker *w;
+    struct batch *b;
+    int n;
+    w = (struct batch_worker *)arg;
+    b = w->batch;
+    while ((n = __sync_fetch_and_add(&b->next, 1)) < b->count) {
+        batch_run(w->ctx, &b->jobs[n]);
+        pthread_mutex_lock(&b->lock);
+        b->jobs[n].done = 1;
+        pthread_cond_signal(&b->finished);
+        pthread_mutex_unlock(&b->lock);
+    }
+    return NULL;
 }
 
-static void load_program(const char *path)
+/* Read input file names, one per line, from standard input for -j with
+ * no names on the command line.  Returns the count, or -1. */
+static int read_batch_list(char ***list)
 {
-    FILE *f;
-    char linebuf[MAX_LINE_LEN];
-    f = fopen(path, "r");
-    if (!f) {
-        fprintf(stderr, "Cannot open %s\n", path);
-        exit(1);
-    }
-    while (fgets(linebuf, sizeof(linebuf), f)) {
-        char *p;
-        int number;
-        trim_newline(linebuf);
-        p = linebuf;
-        while (*p == ' ' || *p == '\t') {
-            p++;
-        }
-        /* Skip UTF-8 BOM if present */
-        if ((unsigned char)p[0] == 0xef && (unsigned char)p[1] == 0xbb && (unsigned char)p[2] == 0xbf) {
-            p += 3;
+    char line[1024];
+    char **names;
+    char **grown;
+    int count;
+    int cap;
+    int len;
+    names = NULL;
+    count = 0;
+    cap = 0;
+    while (fgets(line, sizeof(line), stdin)) {
+        len = (int)strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
         }
-        /* Ignore empty or whitespace-only lines */
-        if (*p == '\0') {
+        if (len == 0) {
             continue;
         }
-        if (!isdigit((unsigned char)*p)) {
-            fprintf(stderr, "Line missing number: %s\n", linebuf);
-            exit(1);
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            grown = (char **)realloc(names, cap * sizeof(char *));
+            if (!grown) {
+                break;
+            }
+            names = grown;
         }
-        number = atoi(p);
-        while (*p && !isspace((unsigned char)*p)) {
-            p++;
+        names[count] = (char *)malloc(len + 1);
+        if (!names[count]) {
+            break;
         }
-        while (*p == ' ' || *p == '\t') {
-            p++;
+        strcpy(names[count++], line);
+    }
+    if (!feof(stdin)) {
+        fprintf(stderr, "Out of memory reading the input list\n");
+        while (count > 0) {
+            free(names[--count]);
         }
-        add_or_replace_line(number, p);
+        free(names);
+        return -1;
     }
-    fclose(f);
-    sort_program();
+    *list = names;
+    return count;
 }
 
-static void run_program(void)
+/* -j: run the loaded program once per input file on `threads' threads,
+ * each with its own clone of `ctx', and write each run's output and
+ * error messages in the order the files were given.  Returns the exit
+ * status: 1 if any input could not be opened. */
+static int run_batch(struct interp *ctx, int threads, char **paths, int count)
 {
-    halted = 0;
-    current_line = 0;
-    statement_pos = NULL;
-    print_col = 0;
-    while (!halted && current_line >= 0 && current_line < line_count) {
-        char *p;
-        if (statement_pos == NULL) {
-            statement_pos = program_lines[current_line]->text;
-        }
-        p = statement_pos;
-        skip_spaces(&p);
-        if (*p == '\0') {
-            current_line++;
-            statement_pos = NULL;
-            continue;
+    struct batch b;
+    struct batch_worker *workers;
+    char **list;
+    int status;
+    int started;
+    int i;
+    list = NULL;
+    if (count == 0) {
+        count = read_batch_list(&list);
+        if (count < 0) {
+            return 1;
         }
-        statement_pos = p;
-        execute_statement(&statement_pos);
-        if (halted) {
+        paths = list;
+    }
+    if (threads > count) {
+        threads = count;
+    }
+    b.jobs = (struct batch_job *)calloc(count ? count : 1, sizeof(struct batch_job));
+    workers = (struct batch_worker *)calloc(threads ? threads : 1, sizeof(struct batch_worker));
+    if (!b.jobs || !workers) {
+        fprintf(stderr, "Out of memory\n");
+        free(b.jobs);
+        free(workers);
+        return 1;
+    }
+    for (i = 0; i < count; i++) {
+        b.jobs[i].path = paths[i];
+    }
+    b.count = count;
+    b.next = 0;
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.finished, NULL);
+    if (ctx->out_interactive < 0) {
+        ctx->out_interactive = 0;
+    }
+    if (ctx->input_batch < 0) {
+        ctx->input_batch = 1;
+    }
+    /* Clone every context before any thread runs */
+    for (i = 0; i < threads; i++) {
+        workers[i].batch = &b;
+        workers[i].ctx = i == 0 ? ctx : basic_clone(ctx);
+        if (!workers[i].ctx) {
+            fprintf(stderr, "Out of memory\n");
             break;
         }
-        if (statement_pos == NULL) {
-            continue;
+    }
+    threads = i;
+    started = 0;
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, batch_thread, &workers[i]) != 0) {
+            break;
         }
-        skip_spaces(&statement_pos);
-        if (*statement_pos == ':') {
-            statement_pos++;
-            continue;
+        started++;
+    }
+    if (started == 0 && count > 0) {
+        fprintf(stderr, "Cannot start worker threads\n");
+        b.count = 0;
+    }
+    status = 0;
+    for (i = 0; i < b.count; i++) {
+        pthread_mutex_lock(&b.lock);
+        while (!b.jobs[i].done) {
+            pthread_cond_wait(&b.finished, &b.lock);
+        }
+        pthread_mutex_unlock(&b.lock);
+        if (b.jobs[i].out_len) {
+            fwrite(b.jobs[i].out, 1, b.jobs[i].out_len, stdout);
+            fflush(stdout);
+        }
+        if (b.jobs[i].err_len) {
+            fwrite(b.jobs[i].err, 1, b.jobs[i].err_len, stderr);
+        }
+        free(b.jobs[i].out);
+        free(b.jobs[i].err);
+        if (b.jobs[i].failed) {
+            status = 1;
         }
-        skip_spaces(&statement_pos);
-        if (*statement_pos == '\0') {
-            current_line++;
-            statement_pos = NULL;
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (i = 1; i < threads; i++) {
+        basic_free(workers[i].ctx);
+    }
+    pthread_cond_destroy(&b.finished);
+    pthread_mutex_destroy(&b.lock);
+    free(workers);
+    free(b.jobs);
+    if (list) {
+        for (i = 0; i < count; i++) {
+            free(list[i]);
         }
+        free(list);
     }
+    return status || b.count < count;
+}
+#endif
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-c] [-g] [-b | -u] [-n] [-p | -pt] [-t] [-s socket | -j n] <program.bas> [input ...]\n", prog);
+    fprintf(stderr, "  -c  save the loaded program as an image (<program.bas>c)\n");
+    fprintf(stderr, "  -g  grow arrays on out-of-range subscripts (old behaviour)\n");
+    fprintf(stderr, "  -b  buffer output, flushing only before INPUT and SLEEP\n");
+    fprintf(stderr, "  -u  flush output after every PRINT\n");
+    fprintf(stderr, "  -n  batch input: no INPUT prompts\n");
+    fprintf(stderr, "  -p  print a profile of line and statement counts at exit\n");
+    fprintf(stderr, "  -pt as -p, also timing each line\n");
+    fprintf(stderr, "  -t  print run statistics at exit (or set BASIC_STATS)\n");
+#ifdef HAVE_SOCKETS
+    fprintf(stderr, "  -s  stay resident, running the program for each connection to socket\n");
+#endif
+#ifdef HAVE_PTHREADS
+    fprintf(stderr, "  -j  run once per input file (named on standard input if none given)\n");
+    fprintf(stderr, "      on n threads, writing the outputs in order\n");
+#endif
 }
 
 int main(int argc, char **argv)
 {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <program.bas>\n", argv[0]);
+    int i;
+    int save_image;
+    char *image;
+    char *socket_path;
+    int threads;
+    struct interp *ctx;
+    ctx = basic_new();
+    if (!ctx) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    save_image = 0;
+    socket_path = NULL;
+    threads = 0;
+    if (getenv("BASIC_STATS")) {
+        ctx->stats = 1;
+    }
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            save_image = 1;
+        } else if (strcmp(argv[i], "-g") == 0) {
+            ctx->array_autogrow = 1;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            ctx->out_interactive = 0;
+        } else if (strcmp(argv[i], "-u") == 0) {
+            ctx->out_interactive = 1;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            ctx->input_batch = 1;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            ctx->profiling = 1;
+        } else if (strcmp(argv[i], "-pt") == 0) {
+            ctx->profiling = 1;
+            ctx->profile_time = 1;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            ctx->stats = 1;
+#ifdef HAVE_SOCKETS
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+#endif
+#ifdef HAVE_PTHREADS
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            threads = atoi(argv[++i]);
+#endif
+        } else {
+            usage(argv[0]);
+            basic_free(ctx);
+            return 1;
+        }
+    }
+    if (i >= argc || (threads && socket_path)) {
+        usage(argv[0]);
+        basic_free(ctx);
         return 1;
     }
-    load_program(argv[1]);
-    run_program();
+    image = image_path(argv[i]);
+    if (save_image || !image || !load_image(ctx, argv[i], image)) {
+        if (!load_program(ctx, argv[i])) {
+            free(image);
+            basic_free(ctx);
+            return 1;
+        }
+        if (save_image && image) {
+            write_image(ctx, argv[i], image);
+        }
+    }
+    free(image);
+#ifdef HAVE_SOCKETS
+    if (socket_path) {
+        i = serve(ctx, socket_path);
+        basic_free(ctx);
+        return i;
+    }
+#endif
+#ifdef HAVE_PTHREADS
+    if (threads) {
+        threads = run_batch(ctx, threads, argv + i + 1, argc - i - 1);
+        basic_free(ctx);
+        return threads;
+    }
+#endif
+    if (ctx->profiling) {
+        profile_start(ctx);
+    }
+    run_program(ctx);
+    out_flush(ctx);
+    profile_report(ctx);
+    stats_report(ctx);
+    basic_free(ctx);
     return 0;
 }
+#endif /* BASIC_NO_MAIN */
@@ -0,0 +1,97 @@
+/*
+ * Embedding interface to the BASIC interpreter.
+ * Copyright (C) 2024  Davepl with various AI assists
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Each interpreter is an independent context holding one program and its
+ * variables, so a host can load and run any number of them.  Build
+ * basic.c with -DBASIC_NO_MAIN to link it into a host program.  A
+ * context may be used by one thread at a time; create the first one
+ * before starting threads.
+ */
+
+#ifndef BASIC_H
+#define BASIC_H
+
+#include <stdio.h>
+
+/* Results of basic_run() and basic_step() */
+#define BASIC_ERROR (-1)    /* stopped by an error, see basic_error() */
+#define BASIC_DONE 0        /* reached END or STOP, or ran off the end */
+#define BASIC_READY 1       /* basic_step() only: more to run */
+#define BASIC_SLEEPING 2    /* basic_step() only: in SLEEP, see below */
+
+struct interp;
+
+/* Create an empty interpreter, or NULL if out of memory. */
+struct interp *basic_new(void);
+
+/* Release an interpreter and everything it holds. */
+void basic_free(struct interp *ctx);
+
+/* Create an interpreter that shares the program loaded in `from', with
+ * its own variables, options and I/O, or NULL if out of memory or
+ * nothing is loaded.  The program is only read, so clones can run on
+ * different threads, but `from' must outlive them. */
+struct interp *basic_clone(struct interp *from);
+
+/* Read INPUT from descriptor in_fd and write output and error messages
+ * to `out' and `err' (by default 0, stdout and stderr). */
+void basic_set_io(struct interp *ctx, int in_fd, FILE *out, FILE *err);
+
+/* Load and crunch a program source file.  Returns 0, having reported
+ * why to the error stream, on failure. */
+int basic_load(struct interp *ctx, const char *path);
+
+/* Clear variables, arrays, loops, the READ position and the RND sequence
+ * for a fresh run, and abandon any run in progress. */
+void basic_reset(struct interp *ctx);
+
+/* Run the program from its first line to the end.  Variables keep the
+ * values they had, so a host can set inputs first. */
+int basic_run(struct interp *ctx);
+
+/* Execute up to `count' statements, starting a run from the first line
+ * unless one is under way.  Returns BASIC_READY while there is more. */
+int basic_step(struct interp *ctx, long count);
+
+/* With `yield' set, SLEEP never blocks: basic_step() returns
+ * BASIC_SLEEPING and does nothing more until basic_clock() reaches
+ * basic_wake_time().  basic_run() still waits.  The clock counts 60Hz
+ * ticks, the unit of SLEEP. */
+void basic_set_sleep_yield(struct interp *ctx, int yield);
+unsigned long basic_wake_time(struct interp *ctx);
+unsigned long basic_clock(void);
+
+/* Run statistics, also read by STAT(n) in BASIC.  They cover the
+ * current or last run, except BASIC_STAT_VARS. */
+#define BASIC_STAT_STATEMENTS 0     /* statements executed */
+#define BASIC_STAT_GOTOS 1          /* GOTO, ON GOTO and IF THEN line jumps */
+#define BASIC_STAT_GOSUBS 2         /* GOSUB and ON GOSUB calls */
+#define BASIC_STAT_VARS 3           /* variables created */
+#define BASIC_STAT_RESIZES 4        /* array allocations and growths */
+#define BASIC_STAT_STR_BYTES 5      /* bytes of string space allocated */
+#define BASIC_STAT_STR_PEAK 6       /* most string space in use */
+#define BASIC_STAT_FOR_PEAK 7       /* deepest FOR nesting */
+#define BASIC_STAT_GOSUB_PEAK 8     /* deepest GOSUB nesting */
+#define BASIC_STAT_SECONDS 9        /* wall time of the run */
+#define BASIC_STAT_COUNT 10
+double basic_stat(struct interp *ctx, int which);
+
+/* Message of the error that stopped the last run, or NULL. */
+const char *basic_error(struct interp *ctx);
+
+/* Set or read a variable by name as a program writes it ("N", "I%",
+ * "NAME$").  The numeric ones return 0 for a bad name or an integer out
+ * of range; basic_get_str() copies at most size - 1 bytes, terminated,
+ * and returns the full length, or -1 for a bad name. */
+int basic_set_num(struct interp *ctx, const char *name, double value);
+int basic_get_num(struct interp *ctx, const char *name, double *value);
+int basic_set_str(struct interp *ctx, const char *name, const char *s);
+int basic_get_str(struct interp *ctx, const char *name, char *buf, int size);
+
+#endif /* BASIC_H */
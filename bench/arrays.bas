@@ -0,0 +1,10 @@
+10 REM Sweeps over large DIM arrays, one and two dimensional
+20 INPUT N
+30 DIM A(2000), M(40, 40)
+40 FOR R = 1 TO N * 10
+50 FOR I = 0 TO 2000: A(I) = I * R: NEXT I
+60 S = 0: FOR I = 2000 TO 0 STEP -1: S = S + A(I): NEXT I
+70 FOR I = 0 TO 40: FOR J = 0 TO 40: M(I, J) = I + J: NEXT J: NEXT I
+80 FOR I = 0 TO 40: FOR J = 0 TO 40: S = S + M(J, I): NEXT J: NEXT I
+90 NEXT R
+100 PRINT "CHECK "; S
@@ -0,0 +1,9 @@
+10 REM Tight FOR/NEXT arithmetic
+20 INPUT N
+30 S = 0
+40 FOR I = 1 TO N * 20000
+50 S = S + I * 2 - (I / 4)
+60 NEXT I
+70 T% = 0
+80 FOR K% = 1 TO N * 20: FOR J% = 1 TO 1000: T% = J% - K%: NEXT J%, K%
+90 PRINT "CHECK "; S; " "; T%
@@ -0,0 +1,20 @@
+10 REM Recursion emulated with GOSUB and an explicit stack: Fibonacci
+20 INPUT N
+30 DIM SK(64)
+40 R = 0
+50 FOR Q = 1 TO N * 4
+60 SP = 0: X = 18: GOSUB 200
+70 R = R + V
+80 NEXT Q
+90 PRINT "CHECK "; R
+100 END
+200 REM V = FIB(X)
+210 IF X < 2 THEN V = X: RETURN
+220 SK(SP) = X: SP = SP + 1
+230 X = X - 1: GOSUB 200
+240 SP = SP - 1: X = SK(SP)
+250 SK(SP) = V: SP = SP + 1
+260 X = X - 2: GOSUB 200
+270 SP = SP - 1: V = V + SK(SP)
+280 X = X + 2
+290 RETURN
@@ -0,0 +1,7 @@
+10 REM PRINT-heavy report output
+20 INPUT N
+30 FOR R = 1 TO N * 3000
+40 PRINT "ROW"; R, R * 3.5, "NAME "; CHR$(65 + R - INT(R / 26) * 26);
+50 PRINT TAB(40); R / 7
+60 NEXT R
+70 PRINT "CHECK "; R
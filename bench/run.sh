@@ -0,0 +1,47 @@
+#!/bin/sh
+# Run the benchmark programs and report wall time and statements/second.
+#
+#   bench/run.sh [interpreter] [scale]
+#
+# The interpreter defaults to ./bsdbasic.  Every program reads a scale
+# factor with INPUT and sizes its work by it, so results are only
+# comparable at the same scale; the default of 50 runs each program for
+# roughly a second on a current PC, and 1 is a better fit for a PDP-11.
+# Each program ends with a CHECK line that should not change between
+# builds.
+
+BASIC=${1:-./bsdbasic}
+SCALE=${2:-50}
+DIR=`dirname "$0"`
+TMP=${TMPDIR:-/tmp}/bench.$$
+
+# Wall clock in seconds; fractional where date(1) supports %N
+now() {
+    t=`date +%s.%N 2>/dev/null`
+    case "$t" in
+    *N*|'') date +%s ;;
+    *) echo "$t" ;;
+    esac
+}
+
+if [ ! -x "$BASIC" ]; then
+    echo "usage: $0 [interpreter] [scale]" >&2
+    exit 1
+fi
+
+printf '%-10s %8s %12s %12s  %s\n' program seconds statements stmts/sec check
+for prog in "$DIR"/*.bas; do
+    name=`basename "$prog" .bas`
+    # A profiled run counts the statements executed ...
+    stmts=`echo "$SCALE" | "$BASIC" -n -b -p "$prog" 2>&1 >/dev/null |
+        awk '/^Profile:/ { print $2 }'`
+    # ... and a plain one is timed
+    start=`now`
+    echo "$SCALE" | "$BASIC" -n -b "$prog" > $TMP.out
+    end=`now`
+    secs=`echo "$start $end" | awk '{ printf "%.2f", $2 - $1 }'`
+    check=`grep '^CHECK' $TMP.out | sed 's/^CHECK *//'`
+    rate=`echo "$stmts $secs" | awk '{ if ($2 > 0) printf "%.0f", $1 / $2; else print "-" }'`
+    printf '%-10s %8s %12s %12s  %s\n' "$name" "$secs" "$stmts" "$rate" "$check"
+done
+rm -f $TMP.out
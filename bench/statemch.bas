@@ -0,0 +1,17 @@
+10 REM GOTO-driven state machine counting words in a synthetic text
+20 INPUT N
+30 T$ = "AB CD  EFG H IJKL   MN OPQ R ST"
+40 W = 0: L = LEN(T$)
+50 FOR R = 1 TO N * 400
+60 P = 1: GOTO 100
+100 REM state: between words
+110 IF P > L THEN 300
+120 IF MID$(T$, P, 1) = " " THEN P = P + 1: GOTO 100
+130 W = W + 1: GOTO 200
+200 REM state: inside a word
+210 P = P + 1
+220 IF P > L THEN 300
+230 IF MID$(T$, P, 1) <> " " THEN 200
+240 GOTO 100
+300 NEXT R
+310 PRINT "CHECK "; W
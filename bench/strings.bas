@@ -0,0 +1,13 @@
+10 REM String building with + and MID$
+20 INPUT N
+30 A$ = "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG"
+40 C = 0
+50 FOR R = 1 TO N * 200
+60 B$ = ""
+70 FOR I = 1 TO LEN(A$)
+80 B$ = MID$(A$, I, 1) + B$
+90 NEXT I
+100 IF MID$(B$, 1, 3) = "GOD" THEN C = C + 1
+110 C = C + LEN(B$ + LEFT$(A$, 5))
+120 NEXT R
+130 PRINT "CHECK "; C; " "; B$
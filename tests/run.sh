@@ -0,0 +1,27 @@
+#!/bin/sh
+# Build and run the embedding tests against basic.c.
+#
+#   tests/run.sh [cc]
+#
+# Each tests/NAME.c is linked with basic.c built with -DBASIC_NO_MAIN and
+# run from the top of the tree with tests/NAME.bas, printing "ok" or the
+# checks that failed.  The exit status is non-zero if any test failed.
+
+CC=${1:-cc}
+DIR=`dirname "$0"`
+TOP=$DIR/..
+TMP=${TMPDIR:-/tmp}/basictest.$$
+status=0
+
+for test in "$DIR"/*.c; do
+    name=`basename "$test" .c`
+    printf '%-12s ' "$name"
+    if ! $CC -DBASIC_NO_MAIN -I"$TOP" -o $TMP "$test" "$TOP/basic.c" -lm; then
+        echo "FAIL: does not build"
+        status=1
+        continue
+    fi
+    $TMP "$DIR/$name.bas" || status=1
+done
+rm -f $TMP
+exit $status
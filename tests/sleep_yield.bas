@@ -0,0 +1,4 @@
+10 PRINT "A"
+20 SLEEP 6
+30 PRINT "B"
+40 SLEEP 6
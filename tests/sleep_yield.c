@@ -0,0 +1,79 @@
+/*
+ * Sleep yield through the embedding interface: each SLEEP, including one
+ * that is the last statement, must report BASIC_SLEEPING and hold the run
+ * until basic_wake_time() has passed.
+ *
+ *   tests/run.sh [cc]
+ */
+
+#include <stdio.h>
+#include "basic.h"
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/* Step until the program stops or sleeps */
+static int step_until_stopped(struct interp *b)
+{
+    int result;
+    int steps;
+    steps = 0;
+    do {
+        result = basic_step(b, 1L);
+        steps++;
+    } while (result == BASIC_READY && steps < 100);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    struct interp *b;
+    FILE *out;
+    int result;
+    int sleeps;
+    unsigned long wake;
+    b = basic_new();
+    out = tmpfile();
+    if (!b || !out) {
+        printf("FAIL: setup\n");
+        return 1;
+    }
+    basic_set_io(b, 0, out, stderr);
+    if (!basic_load(b, argc > 1 ? argv[1] : "tests/sleep_yield.bas")) {
+        return 1;
+    }
+    basic_set_sleep_yield(b, 1);
+    sleeps = 0;
+    for (;;) {
+        result = step_until_stopped(b);
+        if (result != BASIC_SLEEPING) {
+            break;
+        }
+        sleeps++;
+        wake = basic_wake_time(b);
+        check((long)(wake - basic_clock()) > 0, "wake time is in the future");
+        /* Stepping early must not run anything or finish the run */
+        check(basic_step(b, 1L) == BASIC_SLEEPING || (long)(basic_clock() - wake) >= 0,
+              "early step keeps sleeping");
+        while ((long)(basic_clock() - wake) < 0) {
+            ;
+        }
+    }
+    check(result == BASIC_DONE, "run ends with BASIC_DONE");
+    check(sleeps == 2, "both SLEEPs, the last one too, report BASIC_SLEEPING");
+    rewind(out);
+    check(getc(out) == 'A' && getc(out) == '\n' && getc(out) == 'B', "output");
+    fclose(out);
+    basic_free(b);
+    if (failures == 0) {
+        printf("ok\n");
+    }
+    return failures != 0;
+}